@@ -0,0 +1,589 @@
+#ifndef __COLUMN__HEADER__
+#define __COLUMN__HEADER__
+
+#include <assert.h>     // assert
+#include <stdint.h>     // uint64_t
+#include <string.h>     // memcpy, memset
+#include <stdio.h>      // snprintf
+#include <vector>       // std::vector
+#include <algorithm>    // std::sort
+#include "../../include/RecordModel.h"
+#include "MmapFile.h"
+
+/*
+ * Position of a slice within the columns. Computed while iterating over the
+ * slices file.
+ */
+struct SliceRef
+{
+  uint64_t index;       // slice number
+  uint64_t offs;        // index of the first record of the slice
+  uint32_t length;      // number of records
+  uint64_t first_block; // index of the first block (compressed columns)
+};
+
+/*
+ * Stores the values of one field for all records.
+ *
+ * A raw column is a file of fixed-width values (e.g. "k0_4").
+ *
+ * A compressed column consists of two files, the encoded blocks (e.g.
+ * "kz0_4") and a block directory (e.g. "kzb0_4"). Each slice is split into
+ * blocks of BLOCK_SIZE values (blocks never span slices), and each block is
+ * encoded by the codec that gives the smallest result:
+ *
+ *   CODEC_RAW: the values as is.
+ *
+ *   CODEC_FOR: frame of reference. Stores "value - base" (base is the
+ *              minimum of the block) bit-packed with "width" bits per value.
+ *              A block of equal values has width 0 and takes no space.
+ *
+ * Both allow random access to a single value, so bin_search does not need to
+ * decode whole blocks.
+ *
+ * Values are treated as unsigned little endian integers of the field size,
+ * so any field of 1, 2, 4 or 8 bytes can be compressed. Other sizes always
+ * use CODEC_RAW.
+ *
+ * String fields (RM_STR, RM_HEXSTR) are dictionary encoded instead: each
+ * slice gets a sorted dictionary of its distinct values ("kzd0_16", indexed
+ * by "kzdi0_16"), and the blocks store the positions within the dictionary
+ * (codes). As the dictionary is sorted, codes compare like the strings do,
+ * so a search key can be translated into code space once (key_code()) and
+ * then be compared against the codes (compare_code()).
+ */
+class Column
+{
+public:
+
+  static const uint32_t BLOCK_SIZE = 4096;
+
+  static const uint8_t CODEC_RAW = 0;
+  static const uint8_t CODEC_FOR = 1;
+
+  struct BlockInfo
+  {
+    uint64_t offset; // within the data file
+    uint64_t base;
+    uint32_t count;
+    uint8_t codec;
+    uint8_t width;
+    uint16_t _pad;
+  };
+
+  // allows unaligned 64-bit loads at the end of a block
+  static const size_t BLOCK_PAD = 16;
+
+  struct DictInfo
+  {
+    uint64_t first; // index of the first entry within the dictionary file
+    uint64_t count;
+  };
+
+  static uint64_t num_blocks(uint32_t slice_length)
+  {
+    return (slice_length + BLOCK_SIZE - 1) / BLOCK_SIZE;
+  }
+
+  /*
+   * A slice on its way into the column (see stage, reserve and write).
+   */
+  struct Staged
+  {
+    RecordModelInstanceArray *arr;
+    size_t n;
+    std::vector<uint8_t> data;     // the encoded blocks
+    std::vector<BlockInfo> blocks; // with offsets within "data"
+    std::vector<uint8_t> dict;     // the sorted distinct values
+    size_t raw_offset;
+    size_t data_offset;
+    size_t blocks_offset;
+    size_t dict_offset;
+    size_t dict_index_offset;
+  };
+
+private:
+
+  RM_Type *_field;
+  RM_String *_str; // dictionary encoded
+  size_t _size;
+  size_t _vsize;   // size of the values in the blocks (4 for codes)
+  bool _compressed;
+  MmapFile *_raw;
+  MmapFile *_data;
+  MmapFile *_blocks;
+  MmapFile *_dict;
+  MmapFile *_dict_index;
+
+  struct DictOrder
+  {
+    RecordModelInstanceArray *arr;
+    RM_String *str;
+    size_t size;
+
+    bool operator()(uint32_t a, uint32_t b)
+    {
+      return memcmp(str->element_ptr(arr->ptr_at(a)), str->element_ptr(arr->ptr_at(b)), size) < 0;
+    }
+  };
+
+  inline size_t encoded_length(const BlockInfo *bi)
+  {
+    if (bi->codec == CODEC_RAW)
+      return bi->count * _vsize + BLOCK_PAD;
+    return ((uint64_t)bi->count * bi->width + 7) / 8 + BLOCK_PAD;
+  }
+
+  static inline uint64_t unpack(const uint8_t *p, uint64_t i, unsigned width)
+  {
+    if (width == 0) return 0;
+    uint64_t bit = i * width;
+    const uint8_t *q = p + (bit >> 3);
+    unsigned shift = bit & 7;
+    uint64_t w;
+    memcpy(&w, q, 8);
+    uint64_t v = w >> shift;
+    if (shift + width > 64)
+    {
+      v |= ((uint64_t)q[8]) << (64 - shift);
+    }
+    return (width == 64) ? v : (v & ((1ULL << width) - 1));
+  }
+
+  static inline void pack(uint8_t *p, uint64_t i, unsigned width, uint64_t v)
+  {
+    if (width == 0) return;
+    uint64_t bit = i * width;
+    uint8_t *q = p + (bit >> 3);
+    unsigned shift = bit & 7;
+    uint64_t w;
+    memcpy(&w, q, 8);
+    w |= v << shift;
+    memcpy(q, &w, 8);
+    if (shift + width > 64)
+    {
+      q[8] |= (uint8_t)(v >> (64 - shift));
+    }
+  }
+
+  static inline unsigned bit_width(uint64_t v)
+  {
+    return (v == 0) ? 0 : 64 - __builtin_clzll(v);
+  }
+
+  /*
+   * Encodes "count" values (of _vsize bytes each) as one block.
+   */
+  void encode_block(Staged &st, const uint64_t *tmp, uint32_t count)
+  {
+    BlockInfo bi;
+    memset(&bi, 0, sizeof(bi));
+    bi.offset = st.data.size();
+    bi.count = count;
+    bi.codec = CODEC_RAW;
+
+    if (_vsize <= 8 && (_vsize & (_vsize - 1)) == 0)
+    {
+      uint64_t min = tmp[0], max = tmp[0];
+      for (uint32_t i = 1; i < count; ++i)
+      {
+        if (tmp[i] < min) min = tmp[i];
+        if (tmp[i] > max) max = tmp[i];
+      }
+      unsigned width = bit_width(max - min);
+      if (width < 8 * _vsize)
+      {
+        bi.codec = CODEC_FOR;
+        bi.base = min;
+        bi.width = width;
+      }
+    }
+
+    st.data.resize(bi.offset + encoded_length(&bi), 0);
+    uint8_t *p = &st.data[bi.offset];
+
+    if (bi.codec == CODEC_RAW)
+    {
+      for (uint32_t i = 0; i < count; ++i)
+      {
+        memcpy(p + i * _vsize, &tmp[i], _vsize);
+      }
+    }
+    else
+    {
+      for (uint32_t i = 0; i < count; ++i)
+      {
+        pack(p, i, bi.width, tmp[i] - bi.base);
+      }
+    }
+
+    st.blocks.push_back(bi);
+  }
+
+  // fields larger than 8 bytes (e.g. strings) are always stored raw
+  void encode_block_raw(Staged &st, size_t from, uint32_t count)
+  {
+    BlockInfo bi;
+    memset(&bi, 0, sizeof(bi));
+    bi.offset = st.data.size();
+    bi.count = count;
+    bi.codec = CODEC_RAW;
+
+    st.data.resize(bi.offset + encoded_length(&bi), 0);
+    uint8_t *p = &st.data[bi.offset];
+    for (uint32_t i = 0; i < count; ++i)
+    {
+      _field->copy_to_memory(st.arr->ptr_at(from + i), p + i * _size);
+    }
+
+    st.blocks.push_back(bi);
+  }
+
+  /*
+   * Collects the sorted distinct values of the slice as its dictionary, and
+   * returns the code of each record in "codes".
+   */
+  void encode_dict(Staged &st, uint64_t *codes)
+  {
+    std::vector<uint32_t> order(st.n);
+    for (size_t i = 0; i < st.n; ++i) order[i] = i;
+    DictOrder cmp = {st.arr, _str, _size};
+    std::sort(order.begin(), order.end(), cmp);
+
+    uint64_t count = 0;
+    const uint8_t *prev = NULL;
+    for (size_t i = 0; i < st.n; ++i)
+    {
+      const uint8_t *v = _str->element_ptr(st.arr->ptr_at(order[i]));
+      if (!prev || memcmp(prev, v, _size) != 0)
+      {
+        st.dict.insert(st.dict.end(), v, v + _size);
+        ++count;
+        prev = v;
+      }
+      codes[order[i]] = count - 1;
+    }
+  }
+
+  inline const BlockInfo *block(const SliceRef &s, uint64_t index, const uint8_t *&p, uint64_t &i)
+  {
+    i = index - s.offs;
+    const BlockInfo *bi = (const BlockInfo*)_blocks->ptr_read_element(s.first_block + i / BLOCK_SIZE, sizeof(BlockInfo));
+    p = (const uint8_t*)_data->ptr_read_at(bi->offset, encoded_length(bi));
+    i %= BLOCK_SIZE;
+    return bi;
+  }
+
+  // the stored value (or code) of record "index"
+  inline uint64_t decode(const SliceRef &s, uint64_t index)
+  {
+    const uint8_t *p;
+    uint64_t i;
+    const BlockInfo *bi = block(s, index, p, i);
+    if (bi->codec == CODEC_RAW)
+    {
+      uint64_t v = 0;
+      memcpy(&v, p + i * _vsize, _vsize);
+      return v;
+    }
+    return bi->base + unpack(p, i, bi->width);
+  }
+
+public:
+
+  Column()
+  {
+    _field = NULL;
+    _str = NULL;
+    _size = 0;
+    _vsize = 0;
+    _compressed = false;
+    _raw = NULL;
+    _data = NULL;
+    _blocks = NULL;
+    _dict = NULL;
+    _dict_index = NULL;
+  }
+
+  ~Column()
+  {
+    close();
+  }
+
+  bool compressed() { return _compressed; }
+
+  bool has_dict() { return _str != NULL; }
+
+  /*
+   * The files are named "<prefix><kind><idx>_<size>" for a raw column, or
+   * "<prefix><kind>z<idx>_<size>" and "<prefix><kind>zb<idx>_<size>" (block
+   * directory) for a compressed column, plus "<prefix><kind>zd<idx>_<size>"
+   * and "<prefix><kind>zdi<idx>_<size>" for a dictionary.
+   *
+   * "num_slices", "num_records" and "num_blocks" are the committed sizes.
+   */
+  bool open(const char *prefix, const char *kind, size_t idx, RM_Type *field, bool compressed,
+            size_t num_slices, size_t num_records, size_t num_blocks, size_t hint_slices, size_t hint_records,
+            bool readonly, EpochManager *epochs, const MmapFile::Hints &hints = MmapFile::Hints())
+  {
+    assert(!_raw && !_data && !_blocks);
+
+    _field = field;
+    _size = field->size();
+    _compressed = compressed;
+    _str = compressed ? dynamic_cast<RM_String*>(field) : NULL;
+    _vsize = _str ? sizeof(uint32_t) : _size;
+
+    size_t name_sz = strlen(prefix) + 64;
+    char *name = (char*)malloc(name_sz);
+    if (!name) return false;
+
+    bool ok = false;
+
+    if (!compressed)
+    {
+      snprintf(name, name_sz, "%s%s%ld_%ld", prefix, kind, idx, _size);
+      _raw = new MmapFile(NULL, epochs);
+      ok = _raw->open(name, _size*num_records, _size*hint_records, readonly, hints);
+    }
+    else
+    {
+      snprintf(name, name_sz, "%s%szb%ld_%ld", prefix, kind, idx, _size);
+      _blocks = new MmapFile(NULL, epochs);
+      ok = _blocks->open(name, sizeof(BlockInfo)*num_blocks, sizeof(BlockInfo)*(hint_records/BLOCK_SIZE+1), readonly, hints);
+
+      // the size of the data file follows from the last block
+      size_t data_size = 0;
+      if (ok && num_blocks > 0)
+      {
+        const BlockInfo *last = (const BlockInfo*)_blocks->ptr_read_element(num_blocks-1, sizeof(BlockInfo));
+        data_size = last->offset + encoded_length(last);
+      }
+
+      if (ok)
+      {
+        snprintf(name, name_sz, "%s%sz%ld_%ld", prefix, kind, idx, _size);
+        _data = new MmapFile(NULL, epochs);
+        ok = _data->open(name, data_size, _vsize*hint_records/4, readonly, hints);
+      }
+
+      if (ok && _str)
+      {
+        snprintf(name, name_sz, "%s%szdi%ld_%ld", prefix, kind, idx, _size);
+        _dict_index = new MmapFile(NULL, epochs);
+        ok = _dict_index->open(name, sizeof(DictInfo)*num_slices, sizeof(DictInfo)*hint_slices, readonly, hints);
+
+        // the size of the dictionary follows from the last slice
+        size_t dict_size = 0;
+        if (ok && num_slices > 0)
+        {
+          const DictInfo *last = (const DictInfo*)_dict_index->ptr_read_element(num_slices-1, sizeof(DictInfo));
+          dict_size = (last->first + last->count) * _size;
+        }
+
+        if (ok)
+        {
+          snprintf(name, name_sz, "%s%szd%ld_%ld", prefix, kind, idx, _size);
+          _dict = new MmapFile(NULL, epochs);
+          ok = _dict->open(name, dict_size, _size*hint_records/16, readonly, hints);
+        }
+      }
+    }
+
+    free(name);
+    if (!ok) close();
+    return ok;
+  }
+
+  void close()
+  {
+    MmapFile **files[5] = {&_raw, &_data, &_blocks, &_dict, &_dict_index};
+    for (int i = 0; i < 5; ++i)
+    {
+      if (*files[i])
+      {
+        (*files[i])->close();
+        delete *files[i];
+        *files[i] = NULL;
+      }
+    }
+  }
+
+  // adds the underlying files to "out"
+  void files(std::vector<MmapFile*> &out)
+  {
+    MmapFile *all[5] = {_raw, _data, _blocks, _dict, _dict_index};
+    for (int i = 0; i < 5; ++i)
+    {
+      if (all[i]) out.push_back(all[i]);
+    }
+  }
+
+  /*
+   * Encodes the field of the first "n" records of "arr" (in sorted order)
+   * as a new slice. Does not touch the files, so several writers can stage
+   * their slices concurrently.
+   */
+  void stage(Staged &st, RecordModelInstanceArray *arr, size_t n)
+  {
+    st.arr = arr;
+    st.n = n;
+    if (!_compressed) return;
+
+    if (_vsize > 8)
+    {
+      for (size_t i = 0; i < n; i += BLOCK_SIZE)
+      {
+        uint32_t count = (n - i < BLOCK_SIZE) ? (n - i) : BLOCK_SIZE;
+        encode_block_raw(st, i, count);
+      }
+      return;
+    }
+
+    std::vector<uint64_t> tmp(_str ? n : BLOCK_SIZE);
+    if (_str)
+    {
+      encode_dict(st, &tmp[0]);
+    }
+
+    for (size_t i = 0; i < n; i += BLOCK_SIZE)
+    {
+      uint32_t count = (n - i < BLOCK_SIZE) ? (n - i) : BLOCK_SIZE;
+      if (_str)
+      {
+        encode_block(st, &tmp[i], count);
+      }
+      else
+      {
+        for (uint32_t k = 0; k < count; ++k)
+        {
+          tmp[k] = 0;
+          _field->copy_to_memory(arr->ptr_at(i + k), &tmp[k]);
+        }
+        encode_block(st, &tmp[0], count);
+      }
+    }
+  }
+
+  /*
+   * Reserves the space of a staged slice at the end of the files. Slices
+   * are laid out in the order they are reserved in, so calls must be
+   * serialized.
+   */
+  bool reserve(Staged &st)
+  {
+    if (!_compressed)
+    {
+      return _raw->reserve(_size * st.n, st.raw_offset);
+    }
+
+    bool ok = _data->reserve(st.data.size(), st.data_offset) &&
+              _blocks->reserve(sizeof(BlockInfo) * st.blocks.size(), st.blocks_offset);
+    if (ok && _str)
+    {
+      ok = _dict->reserve(st.dict.size(), st.dict_offset) &&
+           _dict_index->reserve(sizeof(DictInfo), st.dict_index_offset);
+    }
+    return ok;
+  }
+
+  /*
+   * Copies a staged slice into its reserved space. Runs concurrently to
+   * other writers, but the caller has to pin the mappings.
+   */
+  void write(const Staged &st)
+  {
+    if (!_compressed)
+    {
+      uint8_t *dst = (uint8_t*)_raw->ptr_reserved(st.raw_offset);
+      for (size_t i = 0; i < st.n; ++i)
+      {
+        _field->copy_to_memory(st.arr->ptr_at(i), dst + i * _size);
+      }
+      return;
+    }
+
+    memcpy(_data->ptr_reserved(st.data_offset), &st.data[0], st.data.size());
+
+    // block offsets are relative to the staged data
+    BlockInfo *blocks = (BlockInfo*)_blocks->ptr_reserved(st.blocks_offset);
+    for (size_t i = 0; i < st.blocks.size(); ++i)
+    {
+      blocks[i] = st.blocks[i];
+      blocks[i].offset += st.data_offset;
+    }
+
+    if (_str)
+    {
+      memcpy(_dict->ptr_reserved(st.dict_offset), &st.dict[0], st.dict.size());
+      DictInfo *di = (DictInfo*)_dict_index->ptr_reserved(st.dict_index_offset);
+      di->first = st.dict_offset / _size;
+      di->count = st.dict.size() / _size;
+    }
+  }
+
+  /*
+   * Returns a pointer to the value of record "index" (which must be within
+   * slice "s"). Compressed values are decoded into "tmp".
+   */
+  inline const void *element(const SliceRef &s, uint64_t index, uint64_t &tmp)
+  {
+    if (!_compressed)
+    {
+      return _raw->ptr_read_element(index, _size);
+    }
+
+    if (_str)
+    {
+      const DictInfo *di = (const DictInfo*)_dict_index->ptr_read_element(s.index, sizeof(DictInfo));
+      return _dict->ptr_read_element(di->first + decode(s, index), _size);
+    }
+
+    const uint8_t *p;
+    uint64_t i;
+    const BlockInfo *bi = block(s, index, p, i);
+
+    if (bi->codec == CODEC_RAW)
+      return p + i * _size;
+
+    tmp = bi->base + unpack(p, i, bi->width);
+    return &tmp;
+  }
+
+  /*
+   * Translates the value of "rec" into the code space of slice "s" (only
+   * for has_dict()): 2*c+1 if it equals the dictionary entry c, otherwise
+   * 2*c, where c is the first entry greater than it.
+   */
+  uint64_t key_code(const SliceRef &s, const void *rec)
+  {
+    assert(_str);
+    const DictInfo *di = (const DictInfo*)_dict_index->ptr_read_element(s.index, sizeof(DictInfo));
+    const uint8_t *key = _str->element_ptr(rec);
+
+    uint64_t l = 0, r = di->count;
+    while (l < r)
+    {
+      uint64_t m = l + (r - l) / 2;
+      int c = memcmp(_dict->ptr_read_element(di->first + m, _size), key, _size);
+      if (c == 0) return 2*m + 1;
+      if (c < 0) l = m + 1;
+      else r = m;
+    }
+    return 2*l;
+  }
+
+  /*
+   * Compares a value translated by key_code() with the value of record
+   * "index", like RM_Type#compare_with_memory.
+   */
+  inline int compare_code(uint64_t key_code, const SliceRef &s, uint64_t index)
+  {
+    uint64_t c = 2*decode(s, index) + 1;
+    if (key_code < c) return -1;
+    if (key_code > c) return 1;
+    return 0;
+  }
+};
+
+#endif
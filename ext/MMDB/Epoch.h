@@ -0,0 +1,114 @@
+#ifndef __EPOCH__HEADER__
+#define __EPOCH__HEADER__
+
+#include <assert.h>     // assert
+#include <stdint.h>     // uint64_t
+#include <pthread.h>    // pthread_mutex_t
+#include <sys/mman.h>   // munmap
+#include <map>          // std::map
+#include <vector>       // std::vector
+
+/*
+ * Epoch-based reclamation of memory mappings.
+ *
+ * Readers pin the current epoch with enter() for the duration of a query,
+ * and leave() it afterwards. When a MmapFile moves its mapping, it publishes
+ * the new pointer first and then retire()s the old mapping, which also
+ * starts a new epoch. The old mapping is only unmapped once all readers that
+ * entered in an epoch up to the one it was retired in have left.
+ *
+ * The mutex is only held within enter(), leave() and retire(), never for
+ * the duration of a query, so neither readers nor the writer ever wait for
+ * each other.
+ */
+class EpochManager
+{
+  struct Retired
+  {
+    void *ptr;
+    size_t length;
+    uint64_t epoch;
+  };
+
+  pthread_mutex_t _mutex;
+  uint64_t _current;
+  std::map<uint64_t, size_t> _readers; // epoch -> number of readers
+  std::vector<Retired> _retired;
+
+  // unmaps the mappings no reader can see anymore
+  void reclaim()
+  {
+    uint64_t oldest = _readers.empty() ? _current : _readers.begin()->first;
+    size_t j = 0;
+    for (size_t i = 0; i < _retired.size(); ++i)
+    {
+      if (_retired[i].epoch < oldest)
+        munmap(_retired[i].ptr, _retired[i].length);
+      else
+        _retired[j++] = _retired[i];
+    }
+    _retired.resize(j);
+  }
+
+public:
+
+  EpochManager()
+  {
+    _current = 0;
+    pthread_mutex_init(&_mutex, NULL);
+  }
+
+  ~EpochManager()
+  {
+    drain();
+    pthread_mutex_destroy(&_mutex);
+  }
+
+  uint64_t enter()
+  {
+    pthread_mutex_lock(&_mutex);
+    uint64_t epoch = _current;
+    ++_readers[epoch];
+    pthread_mutex_unlock(&_mutex);
+    return epoch;
+  }
+
+  void leave(uint64_t epoch)
+  {
+    pthread_mutex_lock(&_mutex);
+    std::map<uint64_t, size_t>::iterator it = _readers.find(epoch);
+    assert(it != _readers.end());
+    if (--it->second == 0)
+    {
+      _readers.erase(it);
+      reclaim();
+    }
+    pthread_mutex_unlock(&_mutex);
+  }
+
+  /*
+   * The mapping must no longer be reachable by new readers.
+   */
+  void retire(void *ptr, size_t length)
+  {
+    pthread_mutex_lock(&_mutex);
+    Retired r = {ptr, length, _current};
+    _retired.push_back(r);
+    ++_current;
+    reclaim();
+    pthread_mutex_unlock(&_mutex);
+  }
+
+  /*
+   * Unmaps all retired mappings. Only when there are no readers.
+   */
+  void drain()
+  {
+    pthread_mutex_lock(&_mutex);
+    assert(_readers.empty());
+    reclaim();
+    pthread_mutex_unlock(&_mutex);
+  }
+};
+
+#endif
@@ -3,9 +3,13 @@
 #include <strings.h> // bzero
 #include "../../include/RecordModel.h"
 #include "MmapFile.h"
+#include "Column.h"
 #include "ruby.h"
 #include <pthread.h>
+#include <alloca.h> // alloca
 #include <set> // std::set
+#include <deque> // std::deque
+#include <algorithm> // std::push_heap
 
 /*
  * Declared in ../RecordModel/RecordModel.cc
@@ -43,10 +47,27 @@ extern RecordModelInstanceArray* get_RecordModelInstanceArray(VALUE);
  * so we can skip a whole slice if one value range has no intersection with the
  * query range.
  *
+ * Optionally (Options::compress), the key files and the values are stored as
+ * block-compressed columns instead (see Column.h). The values are then stored
+ * column-wise (e.g. "vz0_8" for the first value), and there is no data file.
+ *
+ * Optionally (Options::rle), the runs of equal values of the first key within
+ * each slice are stored in "runs_4" (the start of each run relative to the
+ * slice), indexed by "runsi_16" (first run and number of runs per slice).
+ * Queries then position the cursor on the first key by searching the runs
+ * instead of the records.
+ *
+ * Data is deleted by range tombstones, stored in "tombstones_<size>" (see
+ * delete_range). Queries skip the records they cover, or whole slices if a
+ * tombstone covers the min/max range of the slice. The data itself is only
+ * removed by copying the database (see DB#compact_into).
+ *
  * Thread safetly:
  *
  * It is safe to use the methods "put_bulk", "commit" and "query_all"
- * concurrently.
+ * concurrently. Readers pin an epoch while they access the mappings, so that
+ * a mapping which has to move is only unmapped after they are done (see
+ * Epoch.h).
  * 
  */
 struct MMDB
@@ -54,20 +75,132 @@ struct MMDB
 
   RecordModel *model;
 
+  struct Options
+  {
+    bool compress; // block-compressed key and value columns
+    bool rle;      // runs of the first key
+    bool hugepage; // transparent huge pages for the key and value files
+    bool populate; // read in all files on open
+    int numa;      // MmapFile::NUMA_*
+    int numa_node;
+    size_t reserve; // address space reserved per file (see MmapFile::open)
+    bool preallocate; // see MmapFile::Hints
+    size_t growth_cap;
+
+    Options()
+    {
+      compress = false;
+      rle = false;
+      hugepage = false;
+      populate = false;
+      numa = MmapFile::NUMA_DEFAULT;
+      numa_node = 0;
+      reserve = 0;
+      preallocate = false;
+      growth_cap = 0;
+    }
+  };
+
+  struct RunInfo
+  {
+    uint64_t first; // index of the first run within the runs file
+    uint64_t count;
+  };
+
 private:
 
   MmapFile *db_slices;
   MmapFile *db_minmax;
   MmapFile *db_data;
-  MmapFile **db_keys;
+  MmapFile *db_runs;      // only with Options::rle
+  MmapFile *db_run_index;
+  MmapFile *db_tombstones; // missing for readonly databases without deletes
+  size_t num_tombstones;
+  Column **db_keys;
+  Column **db_values; // only with Options::compress
   size_t num_keys;
+  size_t num_values;
   bool readonly;
   size_t num_slices;
   size_t num_records;
+  size_t num_blocks;
+  bool dict_keys; // any key column with a dictionary
+  bool stable_mappings; // see pin
+  Options options;
 
-  pthread_rwlock_t rwlock;
+  EpochManager epochs;
   pthread_mutex_t mutex;
 
+  /*
+   * Slices of concurrent put_bulk calls, in the order their space was
+   * reserved in. "pending_first" is the ticket of the front.
+   */
+  struct Pending
+  {
+    size_t n;
+    bool done;
+    std::vector<size_t> ends; // of the files() after the reservation
+  };
+  std::deque<Pending> pending;
+  size_t pending_first;
+
+  // group commit
+  pthread_mutex_t commit_mutex;
+  pthread_cond_t commit_cond;
+  bool committing;
+  size_t synced_slices;
+  size_t synced_records;
+
+  /*
+   * The mapping hints for a file. The key files are accessed randomly by
+   * bin_search, while the slices and minmax files are scanned by each query.
+   */
+  MmapFile::Hints hints(int advice, bool hugepage)
+  {
+    MmapFile::Hints h;
+    h.advice = advice;
+    h.hugepage = hugepage && options.hugepage;
+    h.populate = options.populate;
+    h.numa = options.numa;
+    h.numa_node = options.numa_node;
+    h.reserve = options.reserve;
+    h.preallocate = options.preallocate;
+    h.growth_cap = options.growth_cap;
+    return h;
+  }
+
+  /*
+   * Readers pin an epoch, so that the mapping of a MmapFile is not ripped
+   * out under them in case it has to be expanded. Not needed if the
+   * mappings cannot move (readonly or reserved address space).
+   */
+  uint64_t pin()
+  {
+    return stable_mappings ? 0 : epochs.enter();
+  }
+
+  void unpin(uint64_t epoch)
+  {
+    if (!stable_mappings) epochs.leave(epoch);
+  }
+
+  void files(std::vector<MmapFile*> &out)
+  {
+    MmapFile *all[5] = {db_slices, db_minmax, db_data, db_runs, db_run_index};
+    for (int i = 0; i < 5; ++i)
+    {
+      if (all[i]) out.push_back(all[i]);
+    }
+    for (size_t i = 0; db_keys && i < num_keys; ++i)
+    {
+      if (db_keys[i]) db_keys[i]->files(out);
+    }
+    for (size_t i = 0; db_values && i < num_values; ++i)
+    {
+      if (db_values[i]) db_values[i]->files(out);
+    }
+  }
+
 public:
 
   MMDB()
@@ -76,34 +209,52 @@ public:
     db_slices = NULL;
     db_minmax = NULL;
     db_data = NULL;
+    db_runs = NULL;
+    db_run_index = NULL;
+    db_tombstones = NULL;
+    num_tombstones = 0;
     db_keys = NULL;
+    db_values = NULL;
     num_keys = 0;
+    num_values = 0;
     readonly = true;
     num_slices = 0;
     num_records = 0;
-    pthread_rwlock_init(&rwlock, NULL);
+    num_blocks = 0;
+    dict_keys = false;
+    stable_mappings = false;
+    committing = false;
+    synced_slices = 0;
+    synced_records = 0;
+    pending_first = 0;
     pthread_mutex_init(&mutex, NULL);
+    pthread_mutex_init(&commit_mutex, NULL);
+    pthread_cond_init(&commit_cond, NULL);
   }
 
   ~MMDB()
   {
     close();
+    pthread_cond_destroy(&commit_cond);
+    pthread_mutex_destroy(&commit_mutex);
     pthread_mutex_destroy(&mutex);
-    pthread_rwlock_destroy(&rwlock);
   }
 
   /*
    * Note that path_prefix must include the trailing '/' if you want to store the databases under it's own directory.
    */
-  bool open(RecordModel *_model, const char *path_prefix, size_t _num_slices, size_t _hint_slices, size_t _num_records, size_t _hint_records, bool _readonly)
+  bool open(RecordModel *_model, const char *path_prefix, size_t _num_slices, size_t _hint_slices, size_t _num_records, size_t _hint_records, bool _readonly,
+            const Options &_options = Options())
   {
     using namespace std;
 
     num_slices = _num_slices;
     num_records = _num_records;
     readonly = _readonly;
+    options = _options;
     model = _model;
     num_keys = model->num_keys();
+    num_values = model->_num_values;
     assert(num_keys > 0);
 
     bool ok;
@@ -113,37 +264,116 @@ public:
 
     // open slices file
     snprintf(name, name_sz, "%sslices_%ld", path_prefix, sizeof(uint32_t));
-    db_slices = new MmapFile(&rwlock);
-    ok = db_slices->open(name, sizeof(uint32_t)*num_slices, sizeof(uint32_t)*_hint_slices, readonly);
+    db_slices = new MmapFile(NULL, &epochs);
+    ok = db_slices->open(name, sizeof(uint32_t)*num_slices, sizeof(uint32_t)*_hint_slices, readonly,
+                         hints(MADV_SEQUENTIAL, false));
     if (!ok) goto fail;
 
+    // blocks of the compressed columns
+    num_blocks = 0;
+    for (size_t s = 0; s < num_slices; ++s)
+    {
+      num_blocks += Column::num_blocks(db_slices->ptr_read_element_at<uint32_t>(s));
+    }
+
+    if (options.rle)
+    {
+      // open run files
+      snprintf(name, name_sz, "%srunsi_%ld", path_prefix, sizeof(RunInfo));
+      db_run_index = new MmapFile(NULL, &epochs);
+      ok = db_run_index->open(name, sizeof(RunInfo)*num_slices, sizeof(RunInfo)*_hint_slices, readonly,
+                              hints(MADV_RANDOM, false));
+      if (!ok) goto fail;
+
+      size_t num_runs = 0;
+      if (num_slices > 0)
+      {
+        const RunInfo *last = (const RunInfo*)db_run_index->ptr_read_element(num_slices-1, sizeof(RunInfo));
+        num_runs = last->first + last->count;
+      }
+
+      snprintf(name, name_sz, "%sruns_%ld", path_prefix, sizeof(uint32_t));
+      db_runs = new MmapFile(NULL, &epochs);
+      ok = db_runs->open(name, sizeof(uint32_t)*num_runs, sizeof(uint32_t)*_hint_slices*16, readonly,
+                         hints(MADV_RANDOM, true));
+      if (!ok) goto fail;
+    }
+
     // open min-max file
     snprintf(name, name_sz, "%sminmax_%ld", path_prefix, model->size());
-    db_minmax = new MmapFile(&rwlock);
-    ok = db_minmax->open(name, model->size()*2*num_slices, model->size()*2*_hint_slices, readonly);
+    db_minmax = new MmapFile(NULL, &epochs);
+    ok = db_minmax->open(name, model->size()*2*num_slices, model->size()*2*_hint_slices, readonly,
+                         hints(MADV_SEQUENTIAL, false));
     if (!ok) goto fail;
 
-    // open data file
-    snprintf(name, name_sz, "%sdata_%ld", path_prefix, model->size_values());
-    db_data = new MmapFile(&rwlock);
-    ok = db_data->open(name, model->size_values()*num_records, model->size_values()*_hint_records, readonly);
-    if (!ok) goto fail;
+    if (!options.compress)
+    {
+      // open data file
+      snprintf(name, name_sz, "%sdata_%ld", path_prefix, model->size_values());
+      db_data = new MmapFile(NULL, &epochs);
+      ok = db_data->open(name, model->size_values()*num_records, model->size_values()*_hint_records, readonly,
+                         hints(MADV_NORMAL, true));
+      if (!ok) goto fail;
+    }
+    else
+    {
+      // open value columns
+      db_values = (Column**) malloc(sizeof(Column*) * num_values);
+      if (!db_values) goto fail;
+      bzero(db_values, sizeof(Column*) * num_values);
+
+      for (size_t i = 0; i < num_values; ++i)
+      {
+        db_values[i] = new Column();
+        ok = db_values[i]->open(path_prefix, "v", i, model->_values[i], true, num_slices, num_records, num_blocks,
+                                _hint_slices, _hint_records, readonly, &epochs, hints(MADV_NORMAL, true));
+        if (!ok) goto fail;
+      }
+    }
 
     // open key files
-    db_keys = (MmapFile**) malloc(sizeof(MmapFile*) * num_keys);
+    db_keys = (Column**) malloc(sizeof(Column*) * num_keys);
     if (!db_keys) goto fail;
-    bzero(db_keys, sizeof(MmapFile*) * num_keys);
+    bzero(db_keys, sizeof(Column*) * num_keys);
 
     for (size_t i = 0; i < num_keys; ++i)
     {
       RM_Type *field = model->_keys[i]; 
       assert(field);
-      snprintf(name, name_sz, "%sk%ld_%d", path_prefix, i, field->size());
-      db_keys[i] = new MmapFile(&rwlock);
-      ok = db_keys[i]->open(name, field->size()*num_records, field->size()*_hint_records, readonly);
+      db_keys[i] = new Column();
+      ok = db_keys[i]->open(path_prefix, "k", i, field, options.compress, num_slices, num_records, num_blocks,
+                            _hint_slices, _hint_records, readonly, &epochs, hints(MADV_RANDOM, true));
+      if (!ok) goto fail;
+      if (db_keys[i]->has_dict()) dict_keys = true;
+    }
+
+    // open tombstones file
+    snprintf(name, name_sz, "%stombstones_%ld", path_prefix, tombstone_size());
+    num_tombstones = count_tombstones(name);
+    if (!readonly || access(name, F_OK) == 0)
+    {
+      db_tombstones = new MmapFile(NULL, &epochs);
+      ok = db_tombstones->open(name, tombstone_size()*num_tombstones, tombstone_size()*64, readonly,
+                               hints(MADV_NORMAL, false));
       if (!ok) goto fail;
+      if (!readonly && !clamp_tombstones()) goto fail;
+    }
+
+    synced_slices = num_slices;
+    synced_records = num_records;
+
+    {
+      std::vector<MmapFile*> all;
+      files(all);
+      if (db_tombstones) all.push_back(db_tombstones);
+      stable_mappings = true;
+      for (size_t i = 0; i < all.size(); ++i)
+      {
+        if (!all[i]->stable()) stable_mappings = false;
+      }
     }
 
+    free(name);
     return true;
 
   fail:
@@ -152,6 +382,9 @@ public:
     return false;
   }
 
+  // false after close()
+  bool is_open() const { return model != NULL; }
+
   void close()
   {
     model = NULL;
@@ -173,63 +406,305 @@ public:
       delete db_data;
       db_data = NULL;
     }
+    if (db_runs)
+    {
+      db_runs->close();
+      delete db_runs;
+      db_runs = NULL;
+    }
+    if (db_run_index)
+    {
+      db_run_index->close();
+      delete db_run_index;
+      db_run_index = NULL;
+    }
+    if (db_tombstones)
+    {
+      db_tombstones->close();
+      delete db_tombstones;
+      db_tombstones = NULL;
+    }
+    num_tombstones = 0;
     if (db_keys)
     {
       for (size_t i = 0; i < num_keys; ++i)
       {
-        MmapFile *f = db_keys[i];
-        if (f)
-        {
-          f->close();
-          delete f;
-        }
+        delete db_keys[i];
         db_keys[i] = NULL;
       }
       free(db_keys);
       db_keys = NULL;
     }
+    if (db_values)
+    {
+      for (size_t i = 0; i < num_values; ++i)
+      {
+        delete db_values[i];
+        db_values[i] = NULL;
+      }
+      free(db_values);
+      db_values = NULL;
+    }
 
     num_keys = 0;
+    num_values = 0;
     readonly = true;
     num_slices = 0;
     num_records = 0;
+    num_blocks = 0;
+    dict_keys = false;
+    stable_mappings = false;
+    pending.clear();
+    pending_first = 0;
+    epochs.drain();
   }
 
-  bool commit(size_t &_num_slices, size_t &_num_records)
+  /*
+   * Deletes the records within [range_from, range_to] (only the keys count)
+   * from all slices written so far. Slices written later are not affected,
+   * so deleted data can be imported again. The tombstone is durable on
+   * return.
+   */
+  bool delete_range(const RecordModelInstance *range_from, const RecordModelInstance *range_to)
   {
     assert(!readonly);
-    bool res = false;
+    assert(range_from->model == model && range_to->model == model);
 
     int err = pthread_mutex_lock(&mutex);
     assert(!err);
 
-    err = pthread_rwlock_rdlock(&rwlock);
+    bool ok = true;
+    uint64_t covers = num_slices;
+    if (covers > 0)
+    {
+      /*
+       * Written in two steps, so that a torn tombstone is never taken as
+       * valid: the range first, then the number of slices it covers, which
+       * completes it (see count_tombstones).
+       */
+      size_t offs = num_tombstones * tombstone_size();
+      uint8_t *p = (uint8_t*)db_tombstones->ptr_write_at(offs, tombstone_size());
+      ok = (p != NULL);
+      if (ok)
+      {
+        memset(p, 0, sizeof(uint64_t));
+        memcpy(p + sizeof(uint64_t), range_from->ptr(), model->size());
+        memcpy(p + sizeof(uint64_t) + model->size(), range_to->ptr(), model->size());
+        ok = sync_tombstones();
+      }
+      if (ok)
+      {
+        p = (uint8_t*)db_tombstones->ptr_write_at(offs, sizeof(uint64_t));
+        memcpy(p, &covers, sizeof(uint64_t));
+        ok = sync_tombstones();
+      }
+      if (ok)
+      {
+        ++num_tombstones;
+      }
+    }
+
+    err = pthread_mutex_unlock(&mutex);
     assert(!err);
-    
-    if (!db_slices->sync())
-      goto end;
 
-    if (!db_minmax->sync())
-      goto end;
+    return ok;
+  }
 
-    if (!db_data->sync())
-      goto end;
+private:
 
-    for (size_t i = 0; i < num_keys; ++i)
+  /*
+   * A tombstone is the number of slices it covers (uint64_t), followed by
+   * the "from" and "to" records of the range.
+   */
+  size_t tombstone_size()
+  {
+    return sizeof(uint64_t) + 2*model->size();
+  }
+
+  inline const uint8_t *tombstone(size_t i)
+  {
+    return (const uint8_t*)db_tombstones->ptr_read_element(i, tombstone_size());
+  }
+
+  /*
+   * The number of complete tombstones in the file. It ends at the first
+   * tombstone covering no slices, which is either torn or the zeroed space
+   * behind the last one.
+   */
+  size_t count_tombstones(const char *name)
+  {
+    FILE *f = fopen(name, "r");
+    if (!f) return 0;
+
+    size_t n = 0;
+    std::vector<uint8_t> buf(tombstone_size());
+    while (fread(&buf[0], buf.size(), 1, f) == 1)
+    {
+      uint64_t covers;
+      memcpy(&covers, &buf[0], sizeof(covers));
+      if (covers == 0) break;
+      ++n;
+    }
+    fclose(f);
+    return n;
+  }
+
+  /*
+   * Tombstones written after the last commit might cover slices that were
+   * lost, and which must not be deleted once they are written again.
+   */
+  bool clamp_tombstones()
+  {
+    bool changed = false;
+    for (size_t i = 0; i < num_tombstones; ++i)
+    {
+      uint64_t covers;
+      memcpy(&covers, tombstone(i), sizeof(covers));
+      if (covers > num_slices)
+      {
+        covers = num_slices;
+        memcpy(db_tombstones->ptr_write_at(i*tombstone_size(), sizeof(covers)), &covers, sizeof(covers));
+        changed = true;
+      }
+    }
+    return !changed || sync_tombstones();
+  }
+
+  bool sync_tombstones()
+  {
+    db_tombstones->publish(db_tombstones->size());
+    db_tombstones->mark_sync();
+    return db_tombstones->sync();
+  }
+
+  /*
+   * Collects the tombstones that might delete records of slice "s" into
+   * "dead". Returns false if one of them deletes the whole slice.
+   */
+  bool tombstones_for(size_t s, std::vector<uint32_t> &dead)
+  {
+    dead.clear();
+    size_t n = num_tombstones;
+    if (n == 0) return true;
+
+    const void *min_ptr = db_minmax->ptr_read_element(2*s, model->size()); 
+    const void *max_ptr = db_minmax->ptr_read_element(2*s+1, model->size()); 
+
+    for (size_t i = 0; i < n; ++i)
+    {
+      const uint8_t *t = tombstone(i);
+      uint64_t covers;
+      memcpy(&covers, t, sizeof(covers));
+      if (s >= covers) continue;
+
+      const void *from = t + sizeof(uint64_t);
+      const void *to = t + sizeof(uint64_t) + model->size();
+      bool overlap = true;
+      bool contains = true;
+      for (size_t k = 0; overlap && k < num_keys; ++k)
+      {
+        RM_Type *field = model->_keys[k];
+        overlap = field->overlap(from, to, min_ptr, max_ptr);
+        contains = contains && field->compare(from, min_ptr) <= 0 && field->compare(max_ptr, to) <= 0;
+      }
+      if (!overlap) continue;
+      if (contains) return false;
+      dead.push_back(i);
+    }
+    return true;
+  }
+
+  bool is_dead(const RecordModelInstance *rec, const std::vector<uint32_t> &dead)
+  {
+    for (size_t i = 0; i < dead.size(); ++i)
+    {
+      const uint8_t *t = tombstone(dead[i]);
+      RecordModelInstance from(model, (void*)(t + sizeof(uint64_t)));
+      RecordModelInstance to(model, (void*)(t + sizeof(uint64_t) + model->size()));
+      if (rec->keys_in_range(&from, &to)) return true;
+    }
+    return false;
+  }
+
+public:
+
+  /*
+   * Makes all slices written so far durable, and returns the committed
+   * state.
+   *
+   * Does not block put_bulk, and concurrent calls are grouped: while one
+   * commit is flushing, further callers wait for it, and only flush again
+   * if it did not cover the slices they have to commit.
+   */
+  bool commit(size_t &_num_slices, size_t &_num_records)
+  {
+    assert(!readonly);
+    bool res = true;
+
+    int err = pthread_mutex_lock(&mutex);
+    assert(!err);
+    size_t target = num_slices;
+    err = pthread_mutex_unlock(&mutex);
+    assert(!err);
+
+    err = pthread_mutex_lock(&commit_mutex);
+    assert(!err);
+    while (committing)
     {
-      if (!db_keys[i]->sync())
-        goto end;
+      pthread_cond_wait(&commit_cond, &commit_mutex);
     }
+    if (synced_slices >= target)
+    {
+      _num_slices = synced_slices;
+      _num_records = synced_records;
+      err = pthread_mutex_unlock(&commit_mutex);
+      assert(!err);
+      return true;
+    }
+    committing = true;
+    err = pthread_mutex_unlock(&commit_mutex);
+    assert(!err);
 
-    _num_slices = num_slices;
-    _num_records = num_records;
-    res = true;
-end:
-    err = pthread_rwlock_unlock(&rwlock);
+    /*
+     * Take the latest state, which also covers the commits that are waiting
+     * for us. The files are flushed up to this state while put_bulk
+     * continues to append.
+     */
+    std::vector<MmapFile*> all;
+
+    err = pthread_mutex_lock(&mutex);
     assert(!err);
+    size_t slices = num_slices;
+    size_t records = num_records;
+    files(all);
+    for (size_t i = 0; i < all.size(); ++i)
+    {
+      all[i]->mark_sync();
+    }
     err = pthread_mutex_unlock(&mutex);
     assert(!err);
 
+    uint64_t epoch = pin();
+    for (size_t i = 0; res && i < all.size(); ++i)
+    {
+      res = all[i]->sync();
+    }
+    unpin(epoch);
+
+    err = pthread_mutex_lock(&commit_mutex);
+    assert(!err);
+    if (res)
+    {
+      synced_slices = slices;
+      synced_records = records;
+      _num_slices = slices;
+      _num_records = records;
+    }
+    committing = false;
+    pthread_cond_broadcast(&commit_cond);
+    err = pthread_mutex_unlock(&commit_mutex);
+    assert(!err);
+
     return res;
   }
 
@@ -243,7 +718,7 @@ end:
    * campaign 3000, we can completely skip this slice, while before, it
    * depended upon the order of keys.
    */
-  void put_bulk(RecordModelInstanceArray *arr, bool verify=false)
+  bool put_bulk(RecordModelInstanceArray *arr, bool verify=false)
   {
     assert(!readonly);
     assert(arr);
@@ -253,7 +728,7 @@ end:
 
     if (n == 0)
     {
-      return;
+      return true;
     }
 
     arr->sort();
@@ -302,58 +777,195 @@ end:
       }
     }
 
+    // the runs of the first key
+    std::vector<uint32_t> runs;
+    if (db_runs)
+    {
+      RM_Type *field = model->_keys[0];
+      for (size_t i = 0; i < n; ++i)
+      {
+        if (i == 0 || field->compare(arr->ptr_at(i-1), arr->ptr_at(i)) != 0)
+        {
+          runs.push_back(i);
+        }
+      }
+    }
+
+    // encode the columns before taking the lock
+    std::vector<Column::Staged> keys(num_keys);
+    std::vector<Column::Staged> values(db_data ? 0 : num_values);
+    for (size_t k = 0; k < num_keys; ++k)
+    {
+      db_keys[k]->stage(keys[k], arr, n);
+    }
+    for (size_t k = 0; k < values.size(); ++k)
+    {
+      db_values[k]->stage(values[k], arr, n);
+    }
+
     /*
-     * There cannot be more than one thread calling put_bulk
-     * at the same time. Use a mutex to guarantee that.
+     * Several threads can call put_bulk at the same time. Under the mutex,
+     * each one only reserves the space of its slice in all files, and then
+     * copies its data concurrently to the others. The slice is published
+     * (num_slices) once it and all slices reserved before it are complete,
+     * so readers never see a gap.
+     *
+     * We might move the memory location of a MmapFile database in case we
+     * have to expand it. The old mapping is retired to "epochs" then.
      */
     int err = pthread_mutex_lock(&mutex);
     assert(!err);
 
+    size_t ticket = pending_first + pending.size();
+
+    /*
+     * Reserve the space in all files first. If one of them cannot grow
+     * (e.g. its reserved address space is exhausted), the reservations are
+     * undone and the database is left unchanged.
+     */
+    std::vector<MmapFile*> all;
+    files(all);
+    std::vector<size_t> sizes;
+    for (size_t i = 0; i < all.size(); ++i)
+    {
+      sizes.push_back(all[i]->size());
+    }
+
+    size_t slices_offset, minmax_offset, runs_offset = 0, run_index_offset = 0, data_offset = 0;
+    bool ok = db_slices->reserve(sizeof(uint32_t), slices_offset) &&
+              db_minmax->reserve(2*model->size(), minmax_offset);
+    if (ok && db_runs)
+    {
+      ok = db_runs->reserve(sizeof(uint32_t)*runs.size(), runs_offset) &&
+           db_run_index->reserve(sizeof(RunInfo), run_index_offset);
+    }
+    if (ok && db_data)
+    {
+      ok = db_data->reserve(model->size_values()*n, data_offset);
+    }
+    for (size_t k = 0; ok && k < values.size(); ++k)
+    {
+      ok = db_values[k]->reserve(values[k]);
+    }
+    for (size_t k = 0; ok && k < num_keys; ++k)
+    {
+      ok = db_keys[k]->reserve(keys[k]);
+    }
+
+    if (!ok)
+    {
+      for (size_t i = 0; i < all.size(); ++i)
+      {
+        all[i]->truncate(sizes[i]);
+      }
+      err = pthread_mutex_unlock(&mutex);
+      assert(!err);
+      RecordModelInstance::deallocate(min);
+      RecordModelInstance::deallocate(max);
+      return false;
+    }
+
     /*
-     * Because we might munmap or mremap the memory location of a MmapFile 
-     * database in case we have to expand it, the code within MmapFile
-     * might acquire an exclusive rwlock lock. 
+     * Store the slice length, runs and min/max records. No other writer
+     * can move the mappings while we hold the mutex.
      */
+    *(uint32_t*)db_slices->ptr_reserved(slices_offset) = n;
 
-    // store the slice length
-    db_slices->append_value<uint32_t>(n);
+    if (db_runs)
+    {
+      RunInfo ri;
+      ri.first = runs_offset / sizeof(uint32_t);
+      ri.count = runs.size();
+      memcpy(db_runs->ptr_reserved(runs_offset), &runs[0], sizeof(uint32_t)*runs.size());
+      *(RunInfo*)db_run_index->ptr_reserved(run_index_offset) = ri;
+    }
 
-    // store min/max records
-    memcpy(db_minmax->ptr_append(model->size()), min_ptr, model->size());
-    memcpy(db_minmax->ptr_append(model->size()), max_ptr, model->size());
+    memcpy(db_minmax->ptr_reserved(minmax_offset), min_ptr, model->size());
+    memcpy(db_minmax->ptr_reserved(minmax_offset + model->size()), max_ptr, model->size());
 
-    // store key/data
-    for (size_t i = 0; i < n; ++i)
+    pending.push_back(Pending());
+    Pending &p = pending.back();
+    p.n = n;
+    p.done = false;
+    for (size_t i = 0; i < all.size(); ++i)
     {
-      store_record(arr->ptr_at(i));
+      p.ends.push_back(all[i]->size());
     }
 
-    num_records += n;
-    ++num_slices;
+    err = pthread_mutex_unlock(&mutex);
+    assert(!err);
+
+    // store key/data
+    uint64_t epoch = pin();
+    if (db_data)
+    {
+      uint8_t *dst = (uint8_t*)db_data->ptr_reserved(data_offset);
+      for (size_t i = 0; i < n; ++i)
+      {
+        for (size_t k = 0; k < model->_num_values; ++k)
+        {
+          RM_Type *field = model->_values[k];
+          field->copy_to_memory(arr->ptr_at(i), dst);
+          dst += field->size();
+        }
+      }
+    }
+    for (size_t k = 0; k < values.size(); ++k)
+    {
+      db_values[k]->write(values[k]);
+    }
+    for (size_t k = 0; k < num_keys; ++k)
+    {
+      db_keys[k]->write(keys[k]);
+    }
+    unpin(epoch);
 
+    err = pthread_mutex_lock(&mutex);
+    assert(!err);
+    pending[ticket - pending_first].done = true;
+    publish_completed();
     err = pthread_mutex_unlock(&mutex);
     assert(!err);
 
     RecordModelInstance::deallocate(min);
     RecordModelInstance::deallocate(max);
+
+    return true;
   }
 
 private:
 
-  inline void store_record(void *rec_ptr)
+  /*
+   * Publishes the complete slices at the front of "pending". Called with
+   * the mutex held.
+   */
+  void publish_completed()
   {
-    // copy data
-    for (size_t k = 0; k < model->_num_values; ++k)
+    if (pending.empty() || !pending.front().done)
     {
-      RM_Type *field = model->_values[k];
-      field->copy_to_memory(rec_ptr, db_data->ptr_append(field->size())); 
+      return;
     }
 
-    // copy keys
-    for (size_t k = 0; k < model->_num_keys; ++k)
+    std::vector<MmapFile*> all;
+    files(all);
+    while (!pending.empty() && pending.front().done)
     {
-      RM_Type *field = model->_keys[k];
-      field->copy_to_memory(rec_ptr, db_keys[k]->ptr_append(field->size())); 
+      Pending &p = pending.front();
+      for (size_t i = 0; i < all.size(); ++i)
+      {
+        all[i]->publish(p.ends[i]);
+      }
+      num_records += p.n;
+      num_blocks += Column::num_blocks(p.n);
+      ++num_slices;
+      pending.pop_front();
+      ++pending_first;
+    }
+
+    // start writing back the slices, so that commit does not have to
+    for (size_t i = 0; i < all.size(); ++i)
+    {
+      all[i]->flush_async();
     }
   }
 
@@ -370,33 +982,85 @@ public:
 private:
 
   /*
-   * Compare the key we are looking for with the element at position 'index'.
+   * Compare the key we are looking for with the element at position 'index'
+   * (within slice 's'). Key columns with a dictionary are compared in code
+   * space, using 'key_codes' (see Column::key_code).
    */
-  inline int compare(const void *key_ptr, uint64_t index)
+  inline int compare(const void *key_ptr, const SliceRef &s, uint64_t index, const uint64_t *key_codes)
   {
+    uint64_t tmp;
     for (size_t i = 0; i < this->num_keys; ++i)
     {
-      RM_Type *field = model->_keys[i];
-      const void *b_ptr = this->db_keys[i]->ptr_read_element(index, field->size());
-
-      int cmp = field->compare_with_memory(key_ptr, b_ptr);
+      int cmp;
+      if (key_codes && db_keys[i]->has_dict())
+      {
+        cmp = db_keys[i]->compare_code(key_codes[i], s, index);
+      }
+      else
+      {
+        RM_Type *field = model->_keys[i];
+        const void *b_ptr = this->db_keys[i]->element(s, index, tmp);
+        cmp = field->compare_with_memory(key_ptr, b_ptr);
+      }
       if (cmp != 0) return cmp;
     }
     return 0;
   }
 
-  void copy_keys_in(RecordModelInstance *rec, uint64_t index)
+  void copy_keys_in(RecordModelInstance *rec, const SliceRef &s, uint64_t index)
   {
+    uint64_t tmp;
     for (size_t i = 0; i < this->num_keys; ++i)
     {
       RM_Type *field = model->_keys[i];
-      const void *c = this->db_keys[i]->ptr_read_element(index, field->size());
+      const void *c = this->db_keys[i]->element(s, index, tmp);
       field->set_from_memory(rec->ptr(), c);
     }
   }
 
-  void copy_values_in(RecordModelInstance *rec, uint64_t index)
-  {
+  /*
+   * Like RecordModelInstance#keys_in_range_pos, but for the keys of the
+   * element at position 'index', without copying them out. Key columns with
+   * a dictionary are compared in code space, using the translated bounds
+   * 'from_codes' and 'to_codes' (see Column::key_code).
+   */
+  int keys_in_range_pos(const SliceRef &s, uint64_t index,
+                        const RecordModelInstance *range_from, const RecordModelInstance *range_to,
+                        const uint64_t *from_codes, const uint64_t *to_codes, int &keypos)
+  {
+    uint64_t tmp;
+    for (size_t i = 0; i < this->num_keys; ++i)
+    {
+      keypos = (int)i;
+      if (db_keys[i]->has_dict())
+      {
+        if (db_keys[i]->compare_code(from_codes[i], s, index) > 0) return -1;
+        if (db_keys[i]->compare_code(to_codes[i], s, index) < 0) return 1;
+      }
+      else
+      {
+        RM_Type *field = model->_keys[i];
+        const void *c = this->db_keys[i]->element(s, index, tmp);
+        int cmp = field->memory_between(c, range_from->ptr(), range_to->ptr());
+        if (cmp != 0) return cmp;
+      }
+    }
+    return 0;
+  }
+
+  void copy_values_in(RecordModelInstance *rec, const SliceRef &s, uint64_t index)
+  {
+    if (db_values)
+    {
+      uint64_t tmp;
+      for (size_t i = 0; i < model->_num_values; ++i)
+      {
+        RM_Type *field = model->_values[i];
+        field->set_from_memory(rec->ptr(), db_values[i]->element(s, index, tmp));
+      }
+      return;
+    }
+
     const void *c = this->db_data->ptr_read_element(index, model->size_values());
 
     for (size_t i = 0; i < model->_num_values; ++i)
@@ -407,10 +1071,22 @@ private:
     }
   }
 
-  int64_t bin_search(int64_t l, int64_t r, const void *key_ptr)
+  int64_t bin_search(const SliceRef &s, int64_t l, int64_t r, const void *key_ptr)
   {
     int64_t m;
 
+    // translate string keys once, so that the search compares integers
+    uint64_t *key_codes = NULL;
+    if (dict_keys)
+    {
+      key_codes = (uint64_t*)alloca(sizeof(uint64_t) * num_keys);
+      for (size_t i = 0; i < num_keys; ++i)
+      {
+        if (db_keys[i]->has_dict())
+          key_codes[i] = db_keys[i]->key_code(s, key_ptr);
+      }
+    }
+
     while (l < r)
     {
       m = l + (r - l) / 2;
@@ -421,7 +1097,7 @@ private:
       assert(m >= 0);
       assert(m >= l);
 
-      int c = compare(key_ptr, m);
+      int c = compare(key_ptr, s, m, key_codes);
       if (c > 0)
       {
         /*
@@ -456,21 +1132,67 @@ private:
     return l;
   }
 
+  /*
+   * Like bin_search, but first searches the runs of the first key for the
+   * run of 'key_ptr', so that only this run needs a binary search (or none,
+   * if the first key of 'key_ptr' does not occur).
+   */
+  int64_t run_search(const SliceRef &s, int64_t l, int64_t r, const void *key_ptr)
+  {
+    if (l > r) return l;
+
+    const RunInfo *ri = (const RunInfo*)db_run_index->ptr_read_element(s.index, sizeof(RunInfo));
+    const uint32_t *starts = (const uint32_t*)db_runs->ptr_read_at(ri->first*sizeof(uint32_t), ri->count*sizeof(uint32_t));
+    RM_Type *field = model->_keys[0];
+    uint64_t tmp;
+
+    // the run containing 'l'
+    uint64_t lo = std::upper_bound(starts, starts + ri->count, (uint32_t)(l - s.offs)) - starts - 1;
+    uint64_t hi = ri->count;
+
+    // the first run with a first key >= the one of 'key_ptr'
+    int cmp = 1;
+    while (lo < hi)
+    {
+      uint64_t m = lo + (hi - lo) / 2;
+      cmp = field->compare_with_memory(key_ptr, db_keys[0]->element(s, s.offs + starts[m], tmp));
+      if (cmp > 0) lo = m + 1;
+      else hi = m;
+    }
+    if (lo == ri->count)
+      return r + 1;
+
+    int64_t run_from = s.offs + starts[lo];
+    int64_t run_to = s.offs + ((lo + 1 < ri->count) ? starts[lo+1] : s.length) - 1;
+    if (run_from < l) run_from = l;
+    if (run_to > r) run_to = r;
+
+    if (field->compare_with_memory(key_ptr, db_keys[0]->element(s, run_from, tmp)) == 0)
+      return bin_search(s, run_from, run_to, key_ptr);
+    return run_from;
+  }
+
+  inline int64_t seek(const SliceRef &s, int64_t l, int64_t r, const void *key_ptr)
+  {
+    return db_runs ? run_search(s, l, r, key_ptr) : bin_search(s, l, r, key_ptr);
+  }
+
 public:
 
   struct iter_data
   {
     MMDB *db;
     RecordModelInstance *current;
+    const SliceRef *slice; // of "cursor"
     uint64_t cursor;
     bool copy_values_in;
   };
 
 private:
 
-  int query(uint64_t idx_from, uint64_t idx_to,
+  int query(const SliceRef &s, uint64_t idx_from, uint64_t idx_to,
             const RecordModelInstance *range_from, const RecordModelInstance *range_to,
-            int (*iterator)(iter_data*), iter_data *data)
+            int (*iterator)(iter_data*), iter_data *data, const std::vector<uint32_t> &dead)
   {
     assert(idx_from <= idx_to);
 
@@ -496,27 +1218,70 @@ private:
     /*
      * Position our cursor using binary search
      */ 
-    uint64_t cursor = bin_search(idx_from, idx_to, range_from->ptr());
+    uint64_t cursor = seek(s, idx_from, idx_to, range_from->ptr());
+
+    return scan(s, cursor, idx_to, range_from, range_to, iterator, data, dead);
+  }
+
+  /*
+   * Linear scan from position "cursor" (up to "idx_to"), which is updated.
+   * If the iterator stops, "cursor" is the position of the current record.
+   * Skips the records deleted by the tombstones "dead" (see tombstones_for).
+   */
+  int scan(const SliceRef &s, uint64_t &cursor, uint64_t idx_to,
+           const RecordModelInstance *range_from, const RecordModelInstance *range_to,
+           int (*iterator)(iter_data*), iter_data *data, const std::vector<uint32_t> &dead)
+  {
+    // translate the bounds of string keys once, so that the scan compares integers
+    uint64_t *from_codes = NULL, *to_codes = NULL;
+    if (dict_keys)
+    {
+      from_codes = (uint64_t*)alloca(2 * sizeof(uint64_t) * num_keys);
+      to_codes = from_codes + num_keys;
+      for (size_t i = 0; i < num_keys; ++i)
+      {
+        if (db_keys[i]->has_dict())
+        {
+          from_codes[i] = db_keys[i]->key_code(s, range_from->ptr());
+          to_codes[i] = db_keys[i]->key_code(s, range_to->ptr());
+        }
+      }
+    }
 
-    /*
-     * Linear scan from current position
-     */
     while (cursor <= idx_to)
     {
-      copy_keys_in(data->current, cursor);
-     
       int keypos;
-      int cmp = data->current->keys_in_range_pos(range_from, range_to, keypos);
+      int cmp;
+      if (from_codes)
+      {
+        cmp = keys_in_range_pos(s, cursor, range_from, range_to, from_codes, to_codes, keypos);
+        // "current" is only needed for a match or a carry-forward below
+        if (cmp == 0 || keypos > 0)
+          copy_keys_in(data->current, s, cursor);
+      }
+      else
+      {
+        copy_keys_in(data->current, s, cursor);
+        cmp = data->current->keys_in_range_pos(range_from, range_to, keypos);
+      }
+
       if (cmp == 0)
       {
         /*
          * all keys are within [range_from, range_to]
          */
+        if (!dead.empty() && is_dead(data->current, dead))
+        {
+          ++cursor;
+          continue;
+        }
+
 	// The values are copied into lazily
+        data->slice = &s;
         data->cursor = cursor;
 	if (data->copy_values_in)
 	{
-          copy_values_in(data->current, cursor);
+          copy_values_in(data->current, s, cursor);
 	}
 
 	/*
@@ -555,7 +1320,7 @@ private:
         /*
          * Search forward
          */
-        cursor = bin_search(cursor+1, idx_to, data->current->ptr());
+        cursor = seek(s, cursor+1, idx_to, data->current->ptr());
       }
       else if (cmp > 0)
       {
@@ -580,7 +1345,7 @@ private:
         /*
          * Search forward
          */
-        cursor = bin_search(cursor+1, idx_to, data->current->ptr());
+        cursor = seek(s, cursor+1, idx_to, data->current->ptr());
       }
     }
 
@@ -632,57 +1397,387 @@ public:
     return db_minmax->ptr_read_element(index, model->size()); 
   }
 
+  /*
+   * For every field check if the requested range has an overlap with the
+   * slice range (min/max records). If only one field has no overlap, we
+   * can skip the whole slice.
+   */
+  bool overlaps(size_t s, const RecordModelInstance *range_from, const RecordModelInstance *range_to)
+  {
+    const void *min_ptr = db_minmax->ptr_read_element(2*s, model->size()); 
+    const void *max_ptr = db_minmax->ptr_read_element(2*s+1, model->size()); 
+    assert(min_ptr && max_ptr);
+
+    return model->overlap_all(range_from->ptr(), range_to->ptr(), min_ptr, max_ptr);
+  }
+
   /*
    * Queries all slices
    * "slices" is equal to snapshots.
    */
   int query_all(size_t slices, const RecordModelInstance *range_from, const RecordModelInstance *range_to,
                  int (*iterator)(iter_data *), iter_data *data)
+  {
+    return query_ranges(0, slices, 1, &range_from, &range_to, iterator, data);
+  }
+
+  /*
+   * Queries the slices [slice_from, slice_to) for "n" ranges in one pass:
+   * the slice metadata (minmax, tombstones) is read once per slice, and
+   * each range that overlaps the slice is searched in turn. A record that
+   * matches several ranges is reported once per range.
+   */
+  int query_ranges(size_t slice_from, size_t slice_to, size_t n,
+                   const RecordModelInstance * const *froms, const RecordModelInstance * const *tos,
+                   int (*iterator)(iter_data *), iter_data *data)
   {
     int iter = ITER_CONTINUE;
     size_t offs = 0;
 
     /*
-     * We set a read lock here so a _ptr of a MmapFile cannot be ripped out under us.
+     * We pin an epoch here so a _ptr of a MmapFile cannot be ripped out under us.
      * in case the mmap has to be expanded.
      */
-    int err = pthread_rwlock_rdlock(&rwlock);
-    assert(!err);
+    uint64_t epoch = pin();
 
-    for (size_t s = 0; s < slices; ++s)
+    SliceRef ref;
+    ref.first_block = 0;
+    std::vector<uint32_t> dead;
+
+    for (size_t s = 0; s < slice_to; ++s)
     {
       uint32_t length = db_slices->ptr_read_element_at<uint32_t>(s);
 
       if (length == 0)
         continue;
 
-      /*
-       * For every field check if the requested range has an overlap with the
-       * slice range (min/max records). If only one field has no overlap, we
-       * can skip the whole slice.
-       */
-      const void *min_ptr = db_minmax->ptr_read_element(2*s, model->size()); 
-      const void *max_ptr = db_minmax->ptr_read_element(2*s+1, model->size()); 
-      assert(min_ptr && max_ptr);
-
-      if (!model->overlap_all(range_from->ptr(), range_to->ptr(), min_ptr, max_ptr))
-      {
-        iter = ITER_CONTINUE;
-      }
-      else
+      if (s >= slice_from)
       {
-        iter = query(offs, offs+length-1, range_from, range_to, iterator, data);
+        ref.index = s;
+        ref.offs = offs;
+        ref.length = length;
+
+        bool checked = false;
+        bool alive = true;
+        for (size_t r = 0; r < n; ++r)
+        {
+          if (!overlaps(s, froms[r], tos[r]))
+            continue;
+          if (!checked)
+          {
+            alive = tombstones_for(s, dead);
+            checked = true;
+          }
+          if (!alive)
+            break;
+
+          iter = query(ref, offs, offs+length-1, froms[r], tos[r], iterator, data, dead);
+          if (iter == ITER_STOP) break;
+        }
         if (iter == ITER_STOP) break;
+        iter = ITER_CONTINUE;
       }
 
       offs += length;
+      ref.first_block += Column::num_blocks(length);
     }
 
-    err = pthread_rwlock_unlock(&rwlock);
-    assert(!err);
+    unpin(epoch);
 
     return iter;
   }
+
+  /*
+   * The position of an ordered cursor within one slice. "head" is the next
+   * match of the slice (if "valid"), and the state of its search.
+   */
+  struct SliceCursor
+  {
+    SliceRef ref;
+    uint64_t pos; // behind "head"
+    RecordModelInstance *head;
+    bool valid;
+    std::vector<uint32_t> dead;
+  };
+
+  /*
+   * A query that is read in batches by fetch(), so that a large result can
+   * be paged through. Between two calls nothing is pinned or locked, as
+   * the position only refers to published slices, which never change.
+   *
+   * An ordered cursor returns the records in key order over all slices:
+   * every overlapping slice is searched separately, and the heads of the
+   * slices are merged by a loser tree. Of equal keys, the record of the
+   * older slice comes first.
+   *
+   * As MMDB is append-only, data is corrected by importing it again. A
+   * dedup cursor (which is always ordered) collapses the records with equal
+   * keys into one, either the last one written (DEDUP_LAST), or one with
+   * the sum of their values (DEDUP_SUM).
+   */
+  static const int DEDUP_NONE = 0;
+  static const int DEDUP_LAST = 1;
+  static const int DEDUP_SUM = 2;
+
+  struct Cursor
+  {
+    RecordModelInstance *from;
+    RecordModelInstance *to;
+    RecordModelInstance *current;
+    size_t snapshot;
+    SliceRef ref;    // the current slice
+    bool positioned; // "pos" is the next record of "ref" to look at
+    uint64_t pos;
+    std::vector<uint32_t> dead; // of "ref"
+
+    bool ordered;
+    int dedup;
+    std::vector<SliceCursor> slices; // set up by the first fetch
+    std::vector<size_t> tree;        // [0] the winner, then the losers
+    bool pending;                    // "current" did not fit into the last fetch
+  };
+
+  static void cursor_open(Cursor &c, const RecordModelInstance *range_from, const RecordModelInstance *range_to, size_t slices,
+                          bool ordered=false, int dedup=DEDUP_NONE)
+  {
+    c.from = range_from->dup();
+    c.to = range_to->dup();
+    c.current = range_from->dup();
+    c.snapshot = slices;
+    c.ref.index = 0;
+    c.ref.offs = 0;
+    c.ref.length = 0;
+    c.ref.first_block = 0;
+    c.positioned = false;
+    c.pos = 0;
+    c.ordered = ordered || (dedup != DEDUP_NONE);
+    c.dedup = dedup;
+    c.pending = false;
+  }
+
+  static void cursor_close(Cursor &c)
+  {
+    RecordModelInstance::deallocate(c.from);
+    RecordModelInstance::deallocate(c.to);
+    RecordModelInstance::deallocate(c.current);
+    for (size_t i = 0; i < c.slices.size(); ++i)
+    {
+      RecordModelInstance::deallocate(c.slices[i].head);
+    }
+    c.slices.clear();
+  }
+
+  struct fetch_iter_data : iter_data
+  {
+    RecordModelInstanceArray *arr;
+    size_t limit;
+    bool stored;
+  };
+
+  static int fetch_iter(iter_data *_data)
+  {
+    fetch_iter_data *data = (fetch_iter_data*)_data;
+    data->stored = data->arr->push(data->current);
+    if (!data->stored || data->arr->entries() >= data->limit)
+      return ITER_STOP;
+    return ITER_CONTINUE;
+  }
+
+  /*
+   * Appends up to "max" further matching records to "arr" (less if it
+   * cannot be expanded). Returns false once the query is exhausted.
+   */
+  bool fetch(Cursor &c, RecordModelInstanceArray *arr, size_t max)
+  {
+    if (c.ordered)
+    {
+      return fetch_ordered(c, arr, max);
+    }
+
+    fetch_iter_data data;
+    data.db = this;
+    data.current = c.current;
+    data.copy_values_in = true;
+    data.arr = arr;
+    data.limit = arr->entries() + max;
+
+    uint64_t epoch = pin();
+
+    while (max > 0 && c.ref.index < c.snapshot)
+    {
+      SliceRef &s = c.ref;
+      if (!c.positioned)
+      {
+        s.length = db_slices->ptr_read_element_at<uint32_t>(s.index);
+        if (s.length > 0 && overlaps(s.index, c.from, c.to) && tombstones_for(s.index, c.dead))
+        {
+          c.pos = seek(s, s.offs, s.offs + s.length - 1, c.from->ptr());
+          c.positioned = true;
+        }
+      }
+
+      if (c.positioned)
+      {
+        data.stored = false;
+        int iter = scan(s, c.pos, s.offs + s.length - 1, c.from, c.to, fetch_iter, (iter_data*)&data, c.dead);
+        if (iter == ITER_STOP)
+        {
+          if (data.stored) ++c.pos;
+          break;
+        }
+      }
+
+      // next slice
+      s.offs += s.length;
+      s.first_block += Column::num_blocks(s.length);
+      ++s.index;
+      c.positioned = false;
+    }
+
+    unpin(epoch);
+
+    return c.ref.index < c.snapshot;
+  }
+
+private:
+
+  static int head_iter(iter_data *)
+  {
+    return ITER_STOP;
+  }
+
+  // moves "sc" to its next match
+  void advance(Cursor &c, SliceCursor &sc)
+  {
+    iter_data data;
+    data.db = this;
+    data.current = sc.head;
+    data.copy_values_in = true;
+
+    int iter = scan(sc.ref, sc.pos, sc.ref.offs + sc.ref.length - 1, c.from, c.to, head_iter, &data, sc.dead);
+    sc.valid = (iter == ITER_STOP);
+    if (sc.valid) ++sc.pos;
+  }
+
+  // true if the head of slice cursor "a" comes before the one of "b"
+  static bool head_before(const Cursor &c, size_t a, size_t b)
+  {
+    const SliceCursor &sa = c.slices[a];
+    const SliceCursor &sb = c.slices[b];
+    if (!sa.valid || !sb.valid) return sa.valid;
+    int cmp = RecordModelInstance::compare_keys_ptr(sa.head->model, sa.head->ptr(), sb.head->ptr());
+    return (cmp < 0 || (cmp == 0 && a < b));
+  }
+
+  /*
+   * Plays the matches below "node" of the loser tree (leaves at
+   * [n, 2n)), stores the losers and returns the winner.
+   */
+  static size_t tree_build(Cursor &c, size_t node)
+  {
+    size_t n = c.slices.size();
+    if (node >= n) return node - n;
+    size_t a = tree_build(c, 2*node);
+    size_t b = tree_build(c, 2*node+1);
+    bool a_wins = head_before(c, a, b);
+    c.tree[node] = a_wins ? b : a;
+    return a_wins ? a : b;
+  }
+
+  // replays the matches of slice cursor "i" (whose head changed) up to the root
+  static void tree_replay(Cursor &c, size_t i)
+  {
+    size_t winner = i;
+    for (size_t node = (i + c.slices.size()) / 2; node >= 1; node /= 2)
+    {
+      if (head_before(c, c.tree[node], winner))
+      {
+        std::swap(c.tree[node], winner);
+      }
+    }
+    c.tree[0] = winner;
+  }
+
+  bool fetch_ordered(Cursor &c, RecordModelInstanceArray *arr, size_t max)
+  {
+    uint64_t epoch = pin();
+
+    if (c.ref.index < c.snapshot)
+    {
+      // position a cursor in every overlapping slice
+      for (SliceRef &s = c.ref; s.index < c.snapshot; ++s.index)
+      {
+        s.length = db_slices->ptr_read_element_at<uint32_t>(s.index);
+        if (s.length > 0 && overlaps(s.index, c.from, c.to))
+        {
+          c.slices.push_back(SliceCursor());
+          SliceCursor &sc = c.slices.back();
+          if (!tombstones_for(s.index, sc.dead))
+          {
+            c.slices.pop_back();
+          }
+          else
+          {
+            sc.ref = s;
+            sc.pos = seek(s, s.offs, s.offs + s.length - 1, c.from->ptr());
+            sc.head = c.current->dup();
+            advance(c, sc);
+          }
+        }
+        s.offs += s.length;
+        s.first_block += Column::num_blocks(s.length);
+      }
+
+      c.tree.resize(c.slices.size());
+      if (!c.slices.empty())
+      {
+        c.tree[0] = tree_build(c, 1);
+      }
+    }
+
+    size_t n = 0;
+    if (c.pending && max > 0)
+    {
+      // already taken from the slices by the last fetch
+      c.pending = !arr->push(c.current);
+      if (!c.pending) ++n;
+    }
+
+    bool more = !c.slices.empty() && c.slices[c.tree[0]].valid;
+    for (; more && !c.pending && n < max; ++n)
+    {
+      if (arr->full() && !arr->expandable)
+        break;
+
+      SliceCursor *sc = &c.slices[c.tree[0]];
+      c.current->copy(sc->head);
+
+      // the records with equal keys are consecutive
+      for (;;)
+      {
+        advance(c, *sc);
+        tree_replay(c, c.tree[0]);
+        sc = &c.slices[c.tree[0]];
+        more = sc->valid;
+        if (!more || c.dedup == DEDUP_NONE || c.current->compare_keys(sc->head) != 0)
+          break;
+
+        if (c.dedup == DEDUP_SUM)
+          c.current->add_values(sc->head);
+        else
+          c.current->copy(sc->head);
+      }
+
+      // if the array cannot grow, the record is kept for the next fetch
+      c.pending = !arr->push(c.current);
+    }
+
+    unpin(epoch);
+
+    return more || c.pending;
+  }
+
+public:
   
   struct min_iter_data : iter_data
   {
@@ -698,13 +1793,13 @@ public:
       if (data->current->compare_keys(data->min) < 0)
       {
 	// XXX: directly copy into min 
-	data->db->copy_values_in(data->current, data->cursor);
+	data->db->copy_values_in(data->current, *data->slice, data->cursor);
         data->min->copy(data->current);
       }
     }
     else
     {
-      data->db->copy_values_in(data->current, data->cursor);
+      data->db->copy_values_in(data->current, *data->slice, data->cursor);
       data->min = data->current->dup(); 
     }
 
@@ -765,6 +1860,106 @@ public:
     return data.count;
   }
 
+  /*
+   * A thread of query_count over several ranges.
+   */
+  struct count_job
+  {
+    MMDB *db;
+    size_t slice_from;
+    size_t slice_to;
+    size_t n;
+    const RecordModelInstance * const *froms;
+    const RecordModelInstance * const *tos;
+    size_t count;
+  };
+
+  static void *count_job_main(void *ptr)
+  {
+    count_job *job = (count_job*)ptr;
+    count_iter_data data;
+    data.db = job->db;
+    data.current = job->froms[0]->dup();
+    data.copy_values_in = false;
+    data.count = 0;
+    job->db->query_ranges(job->slice_from, job->slice_to, job->n, job->froms, job->tos, count_iter, (iter_data*)&data);
+    RecordModelInstance::deallocate(data.current);
+    job->count = data.count;
+    return NULL;
+  }
+
+  static const uint64_t MIN_RECORDS_PER_THREAD = 1L << 20;
+
+  /*
+   * Counts the records matching any of the "n" ranges (once per range)
+   * into "count". The slices are split into up to "threads" stripes of
+   * about the same number of records (at least "min_records" each), which
+   * are searched in parallel. Returns false if a thread failed.
+   */
+  bool query_count(size_t slices, size_t n, const RecordModelInstance * const *froms, const RecordModelInstance * const *tos,
+                   unsigned threads, uint64_t min_records, size_t &count)
+  {
+    count = 0;
+    if (n == 0) return true;
+    if (min_records < 1) min_records = 1;
+
+    uint64_t epoch = pin();
+    uint64_t total = 0;
+    for (size_t s = 0; s < slices; ++s)
+    {
+      total += db_slices->ptr_read_element_at<uint32_t>(s);
+    }
+    if (threads > total / min_records) threads = total / min_records;
+    if (threads < 1) threads = 1;
+
+    std::vector<count_job> jobs(threads);
+    uint64_t offs = 0;
+    size_t s = 0;
+    for (unsigned t = 0; t < threads; ++t)
+    {
+      count_job &job = jobs[t];
+      job.db = this;
+      job.n = n;
+      job.froms = froms;
+      job.tos = tos;
+      job.count = 0;
+      job.slice_from = s;
+      uint64_t end = total * (t+1) / threads;
+      while (s < slices && (offs < end || t == threads-1))
+      {
+        offs += db_slices->ptr_read_element_at<uint32_t>(s);
+        ++s;
+      }
+      job.slice_to = s;
+    }
+    unpin(epoch);
+
+    std::vector<pthread_t> tids(threads);
+    std::vector<bool> started(threads, false);
+    for (unsigned t = 1; t < threads; ++t)
+    {
+      started[t] = (pthread_create(&tids[t], NULL, count_job_main, &jobs[t]) == 0);
+    }
+    count_job_main(&jobs[0]);
+
+    bool ok = true;
+    count = jobs[0].count;
+    for (unsigned t = 1; t < threads; ++t)
+    {
+      if (started[t])
+      {
+        if (pthread_join(tids[t], NULL) != 0)
+          ok = false;
+      }
+      else
+      {
+        count_job_main(&jobs[t]);
+      }
+      count += jobs[t].count;
+    }
+    return ok;
+  }
+
   struct Entry
   {
     void *ptr;
@@ -824,6 +2019,15 @@ public:
  
   void query_aggregate(size_t slices, const RecordModelInstance *range_from, const RecordModelInstance *range_to,
              RecordModelInstance *current, RecordModelInstanceArray *arr, RM_Type **keys /* NULL terminated */, bool sum)
+  {
+    query_aggregate(slices, 1, &range_from, &range_to, current, arr, keys, sum);
+  }
+
+  /*
+   * Aggregates the records matching any of the "n" ranges in one pass.
+   */
+  void query_aggregate(size_t slices, size_t n, const RecordModelInstance * const *froms, const RecordModelInstance * const *tos,
+             RecordModelInstance *current, RecordModelInstanceArray *arr, RM_Type **keys /* NULL terminated */, bool sum)
   {
     Compare c;
     c.keys = keys; // MUST be NULL terminated array 
@@ -837,13 +2041,292 @@ public:
     data.set = &set;
     data.arr = arr;
     data.sum = sum;
-    query_all(slices, range_from, range_to, aggregate_iter, (iter_data*)&data);
+    query_ranges(0, slices, n, froms, tos, aggregate_iter, (iter_data*)&data);
   }
- 
-};
 
-static
-void MMDB__mark(void *ptr)
+  /*
+   * The order of query_top: by "field" (ties by the keys), or by the keys
+   * if NULL.
+   */
+  struct TopOrder
+  {
+    RecordModel *model;
+    RM_Type *field;
+    bool desc;
+
+    // true if "a" ranks before "b"
+    bool operator()(const RecordModelInstance *a, const RecordModelInstance *b) const
+    {
+      int c = field ? field->compare(a->ptr(), b->ptr()) : 0;
+      if (c == 0) c = RecordModelInstance::compare_keys_ptr(model, a->ptr(), b->ptr());
+      return desc ? (c > 0) : (c < 0);
+    }
+  };
+
+  struct top_iter_data : iter_data
+  {
+    std::vector<RecordModelInstance*> *heap; // the last ranked on top
+    size_t k;
+    TopOrder order;
+    bool by_value; // "order" needs the values
+  };
+
+  static int top_iter(iter_data *_data)
+  {
+    top_iter_data *data = (top_iter_data*)_data;
+    std::vector<RecordModelInstance*> &heap = *data->heap;
+
+    if (data->by_value)
+    {
+      data->db->copy_values_in(data->current, *data->slice, data->cursor);
+    }
+
+    if (heap.size() == data->k)
+    {
+      if (!data->order(data->current, heap.front()))
+      {
+        /*
+         * Within a slice the records come in key order, so in ascending key
+         * order none of the remaining ones can make it either.
+         */
+        return (!data->order.field && !data->order.desc) ? ITER_NEXT_SLICE : ITER_CONTINUE;
+      }
+      std::pop_heap(heap.begin(), heap.end(), data->order);
+      RecordModelInstance::deallocate(heap.back());
+      heap.pop_back();
+    }
+
+    if (!data->by_value)
+    {
+      data->db->copy_values_in(data->current, *data->slice, data->cursor);
+    }
+    heap.push_back(data->current->dup());
+    std::push_heap(heap.begin(), heap.end(), data->order);
+
+    return ITER_CONTINUE;
+  }
+
+  /*
+   * Appends the first "k" matching records to "arr", ordered by "field"
+   * (any key or value), or by the keys if NULL. Only "k" records are kept
+   * at any time. Ordered ascending by the keys, each slice is only scanned
+   * until its records cannot make it into the result anymore.
+   * Returns false if "arr" is full.
+   */
+  bool query_top(size_t slices, const RecordModelInstance *range_from, const RecordModelInstance *range_to,
+             RecordModelInstance *current, RecordModelInstanceArray *arr, size_t k, RM_Type *field, bool desc)
+  {
+    if (k == 0) return true;
+
+    std::vector<RecordModelInstance*> heap;
+    heap.reserve(k);
+
+    top_iter_data data;
+    data.db = this;
+    data.current = current;
+    data.copy_values_in = false;
+    data.heap = &heap;
+    data.k = k;
+    data.order.model = model;
+    data.order.field = field;
+    data.order.desc = desc;
+    data.by_value = false;
+    for (size_t i = 0; field && i < model->_num_values; ++i)
+    {
+      if (model->_values[i] == field) data.by_value = true;
+    }
+
+    query_all(slices, range_from, range_to, top_iter, (iter_data*)&data);
+
+    std::sort_heap(heap.begin(), heap.end(), data.order);
+    bool ok = true;
+    for (size_t i = 0; i < heap.size(); ++i)
+    {
+      ok = ok && arr->push(heap[i]);
+      RecordModelInstance::deallocate(heap[i]);
+    }
+    return ok;
+  }
+
+  /*
+   * The key order of records (by pointer), and key equality.
+   */
+  struct KeyLess
+  {
+    RecordModel *model;
+    bool operator()(const void *a, const void *b) const
+    {
+      return RecordModelInstance::compare_keys_ptr(model, a, b) < 0;
+    }
+  };
+
+  struct KeyEqual
+  {
+    RecordModel *model;
+    bool operator()(const void *a, const void *b) const
+    {
+      return RecordModelInstance::compare_keys_ptr(model, a, b) == 0;
+    }
+  };
+
+private:
+
+  /*
+   * Returns the first position in [l, end) whose keys are >= "key_ptr"
+   * (or "end"). Probes l+1, l+2, l+4, ... until it passes the key, then
+   * searches that last interval, so that a key close to "l" is found in
+   * a few steps.
+   */
+  uint64_t gallop(const SliceRef &s, uint64_t l, uint64_t end, const void *key_ptr, const uint64_t *key_codes)
+  {
+    if (l >= end || compare(key_ptr, s, l, key_codes) <= 0)
+      return l;
+
+    // element[lo] < key <= element[hi] (or hi == end)
+    uint64_t lo = l;
+    uint64_t hi;
+    uint64_t step = 1;
+    for (;;)
+    {
+      hi = lo + step;
+      if (hi >= end)
+      {
+        hi = end;
+        break;
+      }
+      if (compare(key_ptr, s, hi, key_codes) <= 0)
+        break;
+      lo = hi;
+      step *= 2;
+    }
+
+    while (hi - lo > 1)
+    {
+      uint64_t m = lo + (hi - lo) / 2;
+      if (compare(key_ptr, s, m, key_codes) > 0)
+        lo = m;
+      else
+        hi = m;
+    }
+    return hi;
+  }
+
+public:
+
+  /*
+   * Appends all records whose keys equal those of one of the records in
+   * "keys" to "arr", slice by slice (and in key order within a slice).
+   *
+   * The distinct probe keys are sorted once and swept through each slice,
+   * each one galloping from the position of the previous one. Slices that
+   * do not overlap the bounding box of the probes are skipped. Returns
+   * false if "arr" is full.
+   */
+  bool multi_get(size_t slices, RecordModelInstanceArray *keys, RecordModelInstance *current, RecordModelInstanceArray *arr)
+  {
+    if (keys->empty())
+      return true;
+
+    std::vector<const void*> probes(keys->entries());
+    for (size_t i = 0; i < probes.size(); ++i)
+    {
+      probes[i] = keys->ptr_at(i);
+    }
+    KeyLess less = {model};
+    KeyEqual equal = {model};
+    std::sort(probes.begin(), probes.end(), less);
+    probes.erase(std::unique(probes.begin(), probes.end(), equal), probes.end());
+
+    RecordModelInstance *lo = current->dup();
+    RecordModelInstance *hi = current->dup();
+    lo->set_min();
+    hi->set_max();
+    for (size_t k = 0; k < num_keys; ++k)
+    {
+      RM_Type *field = model->_keys[k];
+      field->copy(lo->ptr(), probes[0]);
+      field->copy(hi->ptr(), probes[0]);
+      for (size_t i = 1; i < probes.size(); ++i)
+      {
+        if (field->compare(probes[i], lo->ptr()) < 0) field->copy(lo->ptr(), probes[i]);
+        if (field->compare(probes[i], hi->ptr()) > 0) field->copy(hi->ptr(), probes[i]);
+      }
+    }
+
+    uint64_t *key_codes = NULL;
+    if (dict_keys)
+    {
+      key_codes = (uint64_t*)alloca(sizeof(uint64_t) * num_keys);
+    }
+
+    bool ok = true;
+    uint64_t epoch = pin();
+
+    SliceRef ref;
+    ref.first_block = 0;
+    size_t offs = 0;
+    std::vector<uint32_t> dead;
+
+    for (size_t s = 0; ok && s < slices; ++s)
+    {
+      uint32_t length = db_slices->ptr_read_element_at<uint32_t>(s);
+
+      if (length == 0)
+        continue;
+
+      ref.index = s;
+      ref.offs = offs;
+      ref.length = length;
+
+      if (overlaps(s, lo, hi) && tombstones_for(s, dead))
+      {
+        uint64_t pos = offs;
+        uint64_t end = offs + length;
+        for (size_t p = 0; ok && p < probes.size() && pos < end; ++p)
+        {
+          if (key_codes)
+          {
+            for (size_t i = 0; i < num_keys; ++i)
+            {
+              if (db_keys[i]->has_dict())
+                key_codes[i] = db_keys[i]->key_code(ref, probes[p]);
+            }
+          }
+
+          pos = gallop(ref, pos, end, probes[p], key_codes);
+          while (pos < end && compare(probes[p], ref, pos, key_codes) == 0)
+          {
+            copy_keys_in(current, ref, pos);
+            if (dead.empty() || !is_dead(current, dead))
+            {
+              copy_values_in(current, ref, pos);
+              if (!arr->push(current))
+              {
+                ok = false;
+                break;
+              }
+            }
+            ++pos;
+          }
+        }
+      }
+
+      offs += length;
+      ref.first_block += Column::num_blocks(length);
+    }
+
+    unpin(epoch);
+
+    RecordModelInstance::deallocate(lo);
+    RecordModelInstance::deallocate(hi);
+
+    return ok;
+  }
+ 
+};
+
+static
+void MMDB__mark(void *ptr)
 {
   MMDB *mdb = (MMDB*)ptr;
   if (mdb && mdb->model)
@@ -870,15 +2353,60 @@ MMDB* MMDB__get(VALUE self) {
 }
 
 static
-VALUE MMDB__open(VALUE klass, VALUE recordmodel, VALUE path_prefix, VALUE num_slices, VALUE hint_slices, VALUE num_records, VALUE hint_records, VALUE readonly)
+VALUE get_option(VALUE options, const char *name)
+{
+  if (NIL_P(options)) return Qnil;
+  Check_Type(options, T_HASH);
+  return rb_hash_aref(options, ID2SYM(rb_intern(name)));
+}
+
+static
+VALUE MMDB__open(VALUE klass, VALUE recordmodel, VALUE path_prefix, VALUE num_slices, VALUE hint_slices, VALUE num_records, VALUE hint_records, VALUE readonly, VALUE _options)
 {
   Check_Type(path_prefix, T_STRING);
 
   RecordModel *model = get_RecordModel(recordmodel);
 
+  MMDB::Options options;
+  options.compress = RTEST(get_option(_options, "compress"));
+  options.rle = RTEST(get_option(_options, "rle"));
+  options.hugepage = RTEST(get_option(_options, "hugepage"));
+  options.populate = RTEST(get_option(_options, "populate"));
+
+  VALUE numa = get_option(_options, "numa");
+  if (numa == ID2SYM(rb_intern("interleave")))
+  {
+    options.numa = MmapFile::NUMA_INTERLEAVE;
+  }
+  else if (FIXNUM_P(numa))
+  {
+    options.numa = MmapFile::NUMA_BIND;
+    options.numa_node = FIX2INT(numa);
+    if (options.numa_node < 0 || options.numa_node >= 64)
+      rb_raise(rb_eArgError, "Invalid NUMA node");
+  }
+  else if (!NIL_P(numa))
+  {
+    rb_raise(rb_eArgError, "Invalid :numa option");
+  }
+
+  VALUE reserve = get_option(_options, "reserve");
+  if (!NIL_P(reserve))
+  {
+    options.reserve = NUM2ULONG(reserve);
+  }
+
+  options.preallocate = RTEST(get_option(_options, "preallocate"));
+  VALUE growth_cap = get_option(_options, "growth_cap");
+  if (!NIL_P(growth_cap))
+  {
+    options.growth_cap = NUM2ULONG(growth_cap);
+  }
+
   MMDB *mdb = new MMDB;
 
-  bool ok = mdb->open(model, RSTRING_PTR(path_prefix), NUM2ULONG(num_slices), NUM2ULONG(hint_slices), NUM2ULONG(num_records), NUM2ULONG(hint_records), RTEST(readonly));
+  bool ok = mdb->open(model, RSTRING_PTR(path_prefix), NUM2ULONG(num_slices), NUM2ULONG(hint_slices), NUM2ULONG(num_records), NUM2ULONG(hint_records), RTEST(readonly),
+                      options);
   if (!ok)
   {
     delete mdb;
@@ -907,10 +2435,13 @@ static
 VALUE put_bulk(void *ptr)
 {
   Params *params = (Params*)ptr;
-  params->db->put_bulk(params->arr, params->verify);
-  return Qnil;
+  return (params->db->put_bulk(params->arr, params->verify) ? Qtrue : Qfalse);
 }
 
+/*
+ * Returns false if a file could not grow (e.g. its :reserve is exhausted).
+ * The database is unchanged then.
+ */
 static
 VALUE MMDB_put_bulk(VALUE self, VALUE arr)
 {
@@ -923,46 +2454,6 @@ VALUE MMDB_put_bulk(VALUE self, VALUE arr)
   return rb_thread_blocking_region(put_bulk, &p, NULL, NULL);
 }
 
-struct yield_iter_data : MMDB::iter_data
-{
-  VALUE _current;
-};
-
-static
-int yield_iter(MMDB::iter_data *_data)
-{
-  yield_iter_data *data = (yield_iter_data*)_data;
-  rb_yield(data->_current);
-  return MMDB::ITER_CONTINUE;
-}
-
-static
-VALUE MMDB_query_each(VALUE self, VALUE _from, VALUE _to, VALUE _current, VALUE _snapshot)
-{
-  MMDB *db;
-  Data_Get_Struct(self, MMDB, db);
-
-  RecordModelInstance *from = get_RecordModelInstance(_from);
-  RecordModelInstance *to = get_RecordModelInstance(_to);
-  RecordModelInstance *current = get_RecordModelInstance(_current);
-
-  assert(from->model == to->model);
-  assert(from->model == current->model);
-  assert(from->model == db->model);
-
-  struct yield_iter_data d;
-  d.db = db;
-  d.current = current;
-  d.copy_values_in = true;
-  d._current = _current;
-
-  size_t snapshot = NUM2ULONG(_snapshot);
-
-  db->query_all(snapshot, from, to, yield_iter, (MMDB::iter_data*)&d); 
-
-  return Qnil;
-}
-
 struct array_fill_iter_data : MMDB::iter_data
 {
   RecordModelInstanceArray *arr;
@@ -1101,6 +2592,90 @@ VALUE MMDB_query_count(VALUE self, VALUE _from, VALUE _to, VALUE _current, VALUE
   return ULONG2NUM(p.count);
 }
 
+struct Params_query_top
+{
+  MMDB *db;
+  RecordModelInstance *from;
+  RecordModelInstance *to;
+  RecordModelInstance *current;
+  RecordModelInstanceArray *arr;
+  size_t snapshot;
+  size_t k;
+  RM_Type *field;
+  bool desc;
+};
+
+static
+VALUE query_top(void *a)
+{
+  Params_query_top *p = (Params_query_top*)a;
+  bool ok = p->db->query_top(p->snapshot, p->from, p->to, p->current, p->arr, p->k, p->field, p->desc);
+  return (ok ? Qtrue : Qfalse);
+}
+
+/*
+ * Appends the first _k matching records to _arr, ordered by the field with
+ * index _field (or by the keys if nil), descending if _desc. Returns false
+ * if _arr is full.
+ */
+static
+VALUE MMDB_query_top(VALUE self, VALUE _from, VALUE _to, VALUE _current, VALUE _arr, VALUE _k, VALUE _field, VALUE _desc, VALUE _snapshot)
+{
+  Params_query_top p;
+  Data_Get_Struct(self, MMDB, p.db);
+
+  p.from = get_RecordModelInstance(_from);
+  p.to = get_RecordModelInstance(_to);
+  p.current = get_RecordModelInstance(_current);
+  p.arr = get_RecordModelInstanceArray(_arr);
+
+  assert(p.from->model == p.to->model);
+  assert(p.from->model == p.current->model);
+  assert(p.from->model == p.db->model);
+  assert(p.from->model == p.arr->model);
+
+  p.k = NUM2ULONG(_k);
+  p.desc = RTEST(_desc);
+  p.field = NULL;
+  if (!NIL_P(_field))
+  {
+    p.field = p.from->model->get_field(NUM2ULONG(_field));
+    if (!p.field)
+    {
+      rb_raise(rb_eArgError, "invalid field");
+    }
+  }
+  p.snapshot = NUM2ULONG(_snapshot);
+
+  return rb_thread_blocking_region(query_top, &p, NULL, NULL);
+}
+
+/*
+ * Returns a malloc'ed, NULL terminated array of the fields with the
+ * indices in Array _fields.
+ */
+static
+RM_Type **get_fields(RecordModel *model, VALUE _fields)
+{
+  Check_Type(_fields, T_ARRAY);
+  RM_Type **fields = (RM_Type**)malloc(sizeof(RM_Type*)*(RARRAY_LEN(_fields)+1));
+  if (!fields)
+  {
+    rb_raise(rb_eArgError, "failed to alloc memory");
+  }
+  for (int i=0; i < RARRAY_LEN(_fields); ++i)
+  {
+    fields[i] = model->get_field(NUM2ULONG(RARRAY_PTR(_fields)[i]));
+    if (!fields[i])
+    {
+      free(fields);
+      rb_raise(rb_eArgError, "invalid field");
+    }
+  }
+  fields[RARRAY_LEN(_fields)] = NULL;
+  return fields;
+}
+
 static
 VALUE query_aggregate(void *a)
 {
@@ -1132,24 +2707,184 @@ VALUE MMDB_query_aggregate(VALUE self, VALUE _from, VALUE _to, VALUE _current, V
 
   p.snapshot = NUM2ULONG(_snapshot);
 
-  Check_Type(_keys, T_ARRAY);
-  p.keys = (RM_Type**)malloc(sizeof(RM_Type*)*(RARRAY_LEN(_keys)+1));
-  if (!p.keys)
+  p.keys = get_fields(p.from->model, _keys);
+
+  rb_thread_blocking_region(query_aggregate, &p, NULL, NULL);
+
+  free(p.keys);
+
+  return Qnil;
+}
+
+struct Params_query_ranges
+{
+  MMDB *db;
+  std::vector<const RecordModelInstance*> froms;
+  std::vector<const RecordModelInstance*> tos;
+  RecordModelInstance *current;
+  RecordModelInstanceArray *arr;
+  size_t snapshot;
+  size_t count;
+  unsigned threads;
+  uint64_t min_records;
+
+  // for query_aggregate_ranges
+  RM_Type **keys;
+  bool sum;
+};
+
+/*
+ * Raises unless _froms and _tos are Arrays of ranges of the model of "db".
+ */
+static
+void check_ranges(MMDB *db, VALUE _froms, VALUE _tos)
+{
+  Check_Type(_froms, T_ARRAY);
+  Check_Type(_tos, T_ARRAY);
+  if (RARRAY_LEN(_froms) != RARRAY_LEN(_tos))
   {
-    rb_raise(rb_eArgError, "failed to alloc memory");
+    rb_raise(rb_eArgError, "number of froms and tos differ");
   }
-  for (int i=0; i < RARRAY_LEN(_keys); ++i)
+  for (int i=0; i < RARRAY_LEN(_froms); ++i)
   {
-    p.keys[i] = p.from->model->get_field(NUM2ULONG(RARRAY_PTR(_keys)[i]));
-    if (!p.keys[i])
+    if (get_RecordModelInstance(RARRAY_PTR(_froms)[i])->model != db->model ||
+        get_RecordModelInstance(RARRAY_PTR(_tos)[i])->model != db->model)
     {
-      free(p.keys);
-      rb_raise(rb_eArgError, "invalid field");
+      rb_raise(rb_eArgError, "range of another model");
     }
   }
-  p.keys[RARRAY_LEN(_keys)] = NULL;
+}
 
-  rb_thread_blocking_region(query_aggregate, &p, NULL, NULL);
+/*
+ * Fills in the ranges of "p" from the Arrays _froms and _tos. Everything
+ * is checked before, as rb_raise would leak the vectors.
+ */
+static
+void get_ranges(Params_query_ranges &p, VALUE _froms, VALUE _tos)
+{
+  check_ranges(p.db, _froms, _tos);
+  for (int i=0; i < RARRAY_LEN(_froms); ++i)
+  {
+    p.froms.push_back(get_RecordModelInstance(RARRAY_PTR(_froms)[i]));
+    p.tos.push_back(get_RecordModelInstance(RARRAY_PTR(_tos)[i]));
+  }
+}
+
+static
+VALUE query_count_ranges(void *a)
+{
+  Params_query_ranges *p = (Params_query_ranges*)a;
+  bool ok = p->db->query_count(p->snapshot, p->froms.size(), p->froms.data(), p->tos.data(),
+                               p->threads, p->min_records, p->count);
+  return (ok ? Qtrue : Qfalse);
+}
+
+/*
+ * Returns the number of records matching the ranges _froms[i].._tos[i]
+ * (counted once per range), searched by up to _threads threads with at
+ * least _min_records records each.
+ */
+static
+VALUE MMDB_query_count_ranges(VALUE self, VALUE _froms, VALUE _tos, VALUE _threads, VALUE _min_records, VALUE _snapshot)
+{
+  size_t count;
+  bool ok;
+
+  // the ranges have to be freed before we raise
+  {
+    Params_query_ranges p;
+    Data_Get_Struct(self, MMDB, p.db);
+
+    p.threads = NUM2UINT(_threads);
+    p.min_records = NUM2ULONG(_min_records);
+    p.snapshot = NUM2ULONG(_snapshot);
+    p.count = 0;
+    get_ranges(p, _froms, _tos);
+
+    ok = RTEST(rb_thread_blocking_region(query_count_ranges, &p, NULL, NULL));
+    count = p.count;
+  }
+
+  if (!ok)
+  {
+    rb_raise(rb_eRuntimeError, "query_count failed");
+  }
+
+  return ULONG2NUM(count);
+}
+
+static
+VALUE query_into_ranges(void *a)
+{
+  Params_query_ranges *p = (Params_query_ranges*)a;
+  struct array_fill_iter_data d;
+  d.db = p->db;
+  d.current = p->current;
+  d.copy_values_in = true;
+  d.arr = p->arr;
+
+  int iter = p->db->query_ranges(0, p->snapshot, p->froms.size(), p->froms.data(), p->tos.data(),
+                                 array_fill_iter, (MMDB::iter_data*)&d);
+
+  if (iter == MMDB::ITER_STOP)
+    return Qfalse;
+  else
+    return Qtrue;
+}
+
+/*
+ * Like query_into for several ranges, in one pass over the slices. The
+ * records come slice by slice (not range by range).
+ */
+static
+VALUE MMDB_query_into_ranges(VALUE self, VALUE _froms, VALUE _tos, VALUE _current, VALUE _arr, VALUE _snapshot)
+{
+  Params_query_ranges p;
+  Data_Get_Struct(self, MMDB, p.db);
+
+  p.current = get_RecordModelInstance(_current);
+  p.arr = get_RecordModelInstanceArray(_arr);
+
+  assert(p.current->model == p.db->model);
+  assert(p.arr->model == p.db->model);
+
+  p.snapshot = NUM2ULONG(_snapshot);
+  get_ranges(p, _froms, _tos);
+
+  return rb_thread_blocking_region(query_into_ranges, &p, NULL, NULL);
+}
+
+static
+VALUE query_aggregate_ranges(void *a)
+{
+  Params_query_ranges *p = (Params_query_ranges*)a;
+  p->db->query_aggregate(p->snapshot, p->froms.size(), p->froms.data(), p->tos.data(), p->current, p->arr, p->keys, p->sum);
+  return Qnil;
+}
+
+/*
+ * Like query_aggregate for several ranges, in one pass over the slices.
+ */
+static
+VALUE MMDB_query_aggregate_ranges(VALUE self, VALUE _froms, VALUE _tos, VALUE _current, VALUE _arr, VALUE _keys, VALUE _sum, VALUE _snapshot)
+{
+  Params_query_ranges p;
+  Data_Get_Struct(self, MMDB, p.db);
+
+  p.current = get_RecordModelInstance(_current);
+  p.arr = get_RecordModelInstanceArray(_arr);
+
+  assert(p.current->model == p.db->model);
+  assert(p.arr->model == p.db->model);
+
+  p.sum = RTEST(_sum);
+  p.snapshot = NUM2ULONG(_snapshot);
+  // all that can raise first, so that neither "keys" nor the ranges leak
+  check_ranges(p.db, _froms, _tos);
+  p.keys = get_fields(p.db->model, _keys);
+  get_ranges(p, _froms, _tos);
+
+  rb_thread_blocking_region(query_aggregate_ranges, &p, NULL, NULL);
 
   free(p.keys);
 
@@ -1158,8 +2893,100 @@ VALUE MMDB_query_aggregate(VALUE self, VALUE _from, VALUE _to, VALUE _current, V
 
 
 
+struct Params_multi_get
+{
+  MMDB *db;
+  RecordModelInstanceArray *keys;
+  RecordModelInstance *current;
+  RecordModelInstanceArray *arr;
+  size_t snapshot;
+};
+
+static
+VALUE multi_get(void *a)
+{
+  Params_multi_get *p = (Params_multi_get*)a;
+  return (p->db->multi_get(p->snapshot, p->keys, p->current, p->arr) ? Qtrue : Qfalse);
+}
+
 /*
- * TODO: in background
+ * Appends the records whose keys equal those of one of the records in
+ * _keys to _arr. Returns false if _arr is full.
+ */
+static
+VALUE MMDB_multi_get_into(VALUE self, VALUE _keys, VALUE _current, VALUE _arr, VALUE _snapshot)
+{
+  Params_multi_get p;
+  Data_Get_Struct(self, MMDB, p.db);
+
+  p.keys = get_RecordModelInstanceArray(_keys);
+  p.current = get_RecordModelInstance(_current);
+  p.arr = get_RecordModelInstanceArray(_arr);
+
+  if (p.keys->model != p.db->model)
+  {
+    rb_raise(rb_eArgError, "keys of another model");
+  }
+  assert(p.current->model == p.db->model);
+  assert(p.arr->model == p.db->model);
+
+  p.snapshot = NUM2ULONG(_snapshot);
+
+  return rb_thread_blocking_region(multi_get, &p, NULL, NULL);
+}
+
+struct delete_params
+{
+  MMDB *db;
+  RecordModelInstance *from;
+  RecordModelInstance *to;
+};
+
+static
+VALUE delete_range(void *ptr)
+{
+  delete_params *p = (delete_params*)ptr;
+  bool ok = p->db->delete_range(p->from, p->to);
+  return (ok ? Qtrue : Qfalse);
+}
+
+/*
+ * Deletes the records within [_from, _to] written so far (see
+ * MMDB::delete_range). Returns false if the tombstone could not be written.
+ */
+static
+VALUE MMDB_delete_range(VALUE self, VALUE _from, VALUE _to)
+{
+  delete_params p;
+  Data_Get_Struct(self, MMDB, p.db);
+
+  p.from = get_RecordModelInstance(_from);
+  p.to = get_RecordModelInstance(_to);
+
+  assert(p.from->model == p.to->model);
+  assert(p.from->model == p.db->model);
+
+  return rb_thread_blocking_region(delete_range, &p, NULL, NULL);
+}
+
+struct commit_params
+{
+  MMDB *db;
+  size_t num_slices;
+  size_t num_records;
+};
+
+static
+VALUE commit(void *ptr)
+{
+  commit_params *p = (commit_params*)ptr;
+  bool ok = p->db->commit(p->num_slices, p->num_records);
+  return (ok ? Qtrue : Qfalse);
+}
+
+/*
+ * Releases the GVL, so other Ruby threads (e.g. calling put_bulk) continue
+ * while the data is flushed. See DB#commit_async.
  */
 static
 VALUE MMDB_commit(VALUE self)
@@ -1167,17 +2994,19 @@ VALUE MMDB_commit(VALUE self)
   MMDB *db;  
   Data_Get_Struct(self, MMDB, db);
 
-  size_t num_slices = 0;
-  size_t num_records = 0;
+  commit_params p;
+  p.db = db;
+  p.num_slices = 0;
+  p.num_records = 0;
 
-  bool ok = db->commit(num_slices, num_records);
+  VALUE ok = rb_thread_blocking_region(commit, &p, NULL, NULL);
   VALUE res = Qnil;
 
-  if (ok)
+  if (RTEST(ok))
   {
     res = rb_ary_new();  
-    rb_ary_push(res, ULONG2NUM(num_slices));
-    rb_ary_push(res, ULONG2NUM(num_records));
+    rb_ary_push(res, ULONG2NUM(p.num_slices));
+    rb_ary_push(res, ULONG2NUM(p.num_records));
   }
 
   return res;
@@ -1215,19 +3044,134 @@ VALUE MMDB_slices(VALUE self, VALUE _current, VALUE _snapshot)
 
 
 
+/*
+ * A MMDB::Cursor. Keeps the database object alive.
+ */
+struct MMDBCursor
+{
+  VALUE db_obj;
+  MMDB *db;
+  MMDB::Cursor c;
+};
+
+static VALUE cMMDBCursor;
+
+static
+void MMDBCursor__mark(void *ptr)
+{
+  MMDBCursor *cur = (MMDBCursor*)ptr;
+  rb_gc_mark(cur->db_obj);
+}
+
+static
+void MMDBCursor__free(void *ptr)
+{
+  MMDBCursor *cur = (MMDBCursor*)ptr;
+  MMDB::cursor_close(cur->c);
+  delete cur;
+}
+
+/*
+ * Returns a cursor over the records within [_from, _to] of the snapshot,
+ * in key order over all slices if _ordered. With _dedup :last or :sum,
+ * records with equal keys are collapsed (see MMDB::Cursor). Read it with
+ * RecordModelMMDBCursor#fetch.
+ */
+static
+VALUE MMDB_cursor(VALUE self, VALUE _from, VALUE _to, VALUE _snapshot, VALUE _ordered, VALUE _dedup)
+{
+  MMDB *db;
+  Data_Get_Struct(self, MMDB, db);
+
+  RecordModelInstance *from = get_RecordModelInstance(_from);
+  RecordModelInstance *to = get_RecordModelInstance(_to);
+
+  assert(from->model == to->model);
+  assert(from->model == db->model);
+
+  int dedup = MMDB::DEDUP_NONE;
+  if (_dedup == ID2SYM(rb_intern("last")))
+  {
+    dedup = MMDB::DEDUP_LAST;
+  }
+  else if (_dedup == ID2SYM(rb_intern("sum")))
+  {
+    dedup = MMDB::DEDUP_SUM;
+  }
+  else if (!NIL_P(_dedup))
+  {
+    rb_raise(rb_eArgError, "dedup must be :last or :sum");
+  }
+
+  MMDBCursor *cur = new MMDBCursor;
+  cur->db_obj = self;
+  cur->db = db;
+  MMDB::cursor_open(cur->c, from, to, NUM2ULONG(_snapshot), RTEST(_ordered), dedup);
+
+  return Data_Wrap_Struct(cMMDBCursor, MMDBCursor__mark, MMDBCursor__free, cur);
+}
+
+struct fetch_params
+{
+  MMDBCursor *cur;
+  RecordModelInstanceArray *arr;
+  size_t max;
+};
+
+static
+VALUE fetch(void *ptr)
+{
+  fetch_params *p = (fetch_params*)ptr;
+  bool more = p->cur->db->fetch(p->cur->c, p->arr, p->max);
+  return (more ? Qtrue : Qfalse);
+}
+
+/*
+ * Appends up to _max further records to _arr, without holding the GVL.
+ * Returns false once the cursor is exhausted (_arr might still have
+ * received records). Raises IOError once the database is closed.
+ */
+static
+VALUE MMDBCursor_fetch(VALUE self, VALUE _arr, VALUE _max)
+{
+  fetch_params p;
+  Data_Get_Struct(self, MMDBCursor, p.cur);
+  p.arr = get_RecordModelInstanceArray(_arr);
+  p.max = NUM2ULONG(_max);
+
+  if (!p.cur->db->is_open())
+  {
+    rb_raise(rb_eIOError, "database closed");
+  }
+
+  assert(p.arr->model == p.cur->db->model);
+
+  return rb_thread_blocking_region(fetch, &p, NULL, NULL);
+}
+
 extern "C"
 void Init_RecordModelMMDBExt()
 {
   VALUE cMMDB = rb_define_class("RecordModelMMDB", rb_cObject);
-  rb_define_singleton_method(cMMDB, "open", (VALUE (*)(...)) MMDB__open, 7);
+  rb_define_singleton_method(cMMDB, "open", (VALUE (*)(...)) MMDB__open, 8);
   rb_define_method(cMMDB, "close", (VALUE (*)(...)) MMDB_close, 0);
   rb_define_method(cMMDB, "put_bulk", (VALUE (*)(...)) MMDB_put_bulk, 1);
-  rb_define_method(cMMDB, "query_each", (VALUE (*)(...)) MMDB_query_each, 4);
   rb_define_method(cMMDB, "query_into", (VALUE (*)(...)) MMDB_query_into, 5);
   rb_define_method(cMMDB, "query_min", (VALUE (*)(...)) MMDB_query_min, 4);
   rb_define_method(cMMDB, "query_count", (VALUE (*)(...)) MMDB_query_count, 4);
   rb_define_method(cMMDB, "query_aggregate", (VALUE (*)(...)) MMDB_query_aggregate, 7);
+  rb_define_method(cMMDB, "query_top", (VALUE (*)(...)) MMDB_query_top, 8);
+  rb_define_method(cMMDB, "query_count_ranges", (VALUE (*)(...)) MMDB_query_count_ranges, 5);
+  rb_define_const(cMMDB, "MIN_RECORDS_PER_THREAD", ULONG2NUM(MMDB::MIN_RECORDS_PER_THREAD));
+  rb_define_method(cMMDB, "query_into_ranges", (VALUE (*)(...)) MMDB_query_into_ranges, 5);
+  rb_define_method(cMMDB, "query_aggregate_ranges", (VALUE (*)(...)) MMDB_query_aggregate_ranges, 7);
+  rb_define_method(cMMDB, "multi_get_into", (VALUE (*)(...)) MMDB_multi_get_into, 4);
   rb_define_method(cMMDB, "commit", (VALUE (*)(...)) MMDB_commit, 0);
+  rb_define_method(cMMDB, "delete_range", (VALUE (*)(...)) MMDB_delete_range, 2);
   rb_define_method(cMMDB, "get_snapshot_num", (VALUE (*)(...)) MMDB_get_snapshot_num, 0);
   rb_define_method(cMMDB, "slices", (VALUE (*)(...)) MMDB_slices, 2);
+  rb_define_method(cMMDB, "cursor", (VALUE (*)(...)) MMDB_cursor, 5);
+
+  cMMDBCursor = rb_define_class("RecordModelMMDBCursor", rb_cObject);
+  rb_define_method(cMMDBCursor, "fetch", (VALUE (*)(...)) MMDBCursor_fetch, 2);
 }
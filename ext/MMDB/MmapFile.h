@@ -4,13 +4,17 @@
 #include <assert.h>     // assert
 #include <sys/types.h>  // open, fstat, ftruncate
 #include <sys/stat.h>   // open, fstat
-#include <fcntl.h>      // open
+#include <fcntl.h>      // open, sync_file_range, fallocate
 #include <unistd.h>     // close, fstat, ftruncate
 #include <sys/mman.h>   // mmap, munmap
 #include <algorithm>    // std::max
 #include <pthread.h>    // pthread_rwlock_t
+#include "Epoch.h"
 #include <errno.h>	// errno
 #include <string.h>	// strerror
+#ifdef HAVE_NUMA
+#include <numaif.h>     // mbind
+#endif
 
 #define LOG_ERR(reason) fprintf(stderr, "%s\n", reason);
 #ifndef LOG_ERR
@@ -19,30 +23,151 @@
 
 class MmapFile
 {
+public:
+
+  static const int NUMA_DEFAULT = 0;
+  static const int NUMA_INTERLEAVE = 1; // over all nodes
+  static const int NUMA_BIND = 2;       // to "numa_node"
+
+  /*
+   * How the kernel should treat the mapping. Applied again whenever the
+   * mapping changes (expand). Also how the file grows.
+   *
+   * The NUMA policy is only honoured for files on tmpfs/hugetlbfs (e.g. a
+   * database in /dev/shm). Page cache pages of regular files are placed
+   * according to the policy of the process instead. Without libnuma it is
+   * ignored.
+   */
+  struct Hints
+  {
+    int advice;     // MADV_NORMAL, MADV_RANDOM or MADV_SEQUENTIAL
+    bool hugepage;  // MADV_HUGEPAGE (transparent huge pages)
+    bool populate;  // MAP_POPULATE, i.e. read in the data on open
+    int numa;
+    int numa_node;
+    size_t reserve; // address space to reserve for growth (see open)
+    bool preallocate; // allocate the blocks on growth (fallocate), instead of a sparse file
+    size_t growth_cap; // the capacity doubles up to this size, then grows by it (0: always doubles)
+
+    Hints()
+    {
+      advice = MADV_NORMAL;
+      hugepage = false;
+      populate = false;
+      numa = NUMA_DEFAULT;
+      numa_node = 0;
+      reserve = 0;
+      preallocate = false;
+      growth_cap = 0;
+    }
+  };
+
+private:
+
   int _fh;
   size_t _size;
   size_t _capa;
   bool _readonly;
   void *_ptr;
   pthread_rwlock_t *_rwlock;
+  EpochManager *_epochs;
+  size_t _flushed;   // writeback was started up to here (flush_async)
+  size_t _sync_mark; // sync() flushes up to here (mark_sync)
+  size_t _sync_from; // ... and from here
+  size_t _synced;    // durable up to here
+  size_t _low_write; // lowest offset written since mark_sync()
+  size_t _reserved;  // size of the reserved address space, or 0
+  size_t _published; // complete up to here (see reserve)
+  Hints _hints;
+
+  // failures are ignored, as these are only hints
+  void apply_hints(void *ptr, size_t length)
+  {
+    if (_hints.advice != MADV_NORMAL)
+      madvise(ptr, length, _hints.advice);
+#ifdef MADV_HUGEPAGE
+    if (_hints.hugepage)
+      madvise(ptr, length, MADV_HUGEPAGE);
+#endif
+#ifdef HAVE_NUMA
+    if (_hints.numa != NUMA_DEFAULT)
+    {
+      unsigned long nodemask = (_hints.numa == NUMA_BIND) ? (1UL << _hints.numa_node) : ~0UL;
+      mbind(ptr, length, (_hints.numa == NUMA_BIND) ? MPOL_BIND : MPOL_INTERLEAVE,
+            &nodemask, 8*sizeof(nodemask), 0);
+    }
+#endif
+  }
+
+  static size_t page_align(size_t offset)
+  {
+    static const size_t page_size = sysconf(_SC_PAGESIZE);
+    return offset - (offset % page_size);
+  }
+
+  /*
+   * Sets the size of the file to "capa" (from "old_size"). With
+   * Hints::preallocate the new blocks are allocated, so that appends by
+   * several files do not interleave on disk. Falls back to ftruncate if the
+   * filesystem does not support it.
+   */
+  static int resize(int fh, size_t old_size, size_t capa, bool preallocate)
+  {
+#ifdef FALLOC_FL_KEEP_SIZE // Linux
+    if (preallocate && capa > old_size)
+    {
+      if (fallocate(fh, 0, old_size, capa - old_size) == 0)
+        return 0;
+      if (errno != EOPNOTSUPP)
+        return -1;
+    }
+#endif
+    return ftruncate(fh, capa);
+  }
 
 public:
 
-  MmapFile(pthread_rwlock_t *rwlock)
+  /*
+   * When the mapping has to move (expand), the old one is either unmapped
+   * under the write lock of "rwlock" (readers hold the read lock), or
+   * retired to "epochs" (readers pin an epoch), if given.
+   */
+  MmapFile(pthread_rwlock_t *rwlock, EpochManager *epochs = NULL)
   {
+    assert(rwlock || epochs);
     _fh = -1;
     _size = 0;
     _capa = 0;
     _readonly = true;
     _ptr = NULL;
     _rwlock = rwlock;
+    _epochs = epochs;
+    _flushed = 0;
+    _sync_mark = 0;
+    _sync_from = 0;
+    _synced = 0;
+    _low_write = (size_t)-1;
+    _reserved = 0;
+    _published = 0;
   }
 
   size_t size() { return _size; }
 
+  /*
+   * True if the mapping never moves, so readers do not need the read lock.
+   */
+  bool stable() { return _readonly || _reserved > 0; }
+
   bool valid() { return (_fh != -1 && _ptr != NULL); }
 
-  bool open(const char *path, size_t size, size_t capacity, bool readonly)
+  /*
+   * With "hints.reserve" (and not readonly), "hints.reserve" bytes of
+   * address space are reserved upfront, and the file is mapped at its
+   * start. expand() then maps the new extents behind it (MAP_FIXED), so
+   * the mapping never moves and no write lock is needed. The file cannot
+   * grow beyond "hints.reserve" then.
+   */
+  bool open(const char *path, size_t size, size_t capacity, bool readonly, const Hints &hints = Hints())
   {
     int err;
 
@@ -92,11 +217,17 @@ public:
         capacity = 1L<<20;
     }
 
+    // keep the space preallocated before (see close)
+    if (!readonly && hints.preallocate && (size_t)buf.st_size > capacity)
+    {
+      capacity = buf.st_size;
+    }
+
     assert(capacity >= size);
 
     if (!readonly)
     {
-      err = ftruncate(fh, capacity); 
+      err = (capacity > (size_t)buf.st_size) ? resize(fh, buf.st_size, capacity, hints.preallocate) : ftruncate(fh, capacity);
       if (err != 0)
       {
         LOG_ERR("ftruncate failed");
@@ -105,19 +236,49 @@ public:
       }
    }
 
-    void *ptr = mmap(NULL, capacity, PROT_READ | (readonly ? 0 : PROT_WRITE), MAP_SHARED, fh, 0);
+    void *base = NULL;
+    size_t reserved = 0;
+    if (!readonly && hints.reserve > 0)
+    {
+      reserved = std::max(hints.reserve, capacity);
+      base = mmap(NULL, reserved, PROT_NONE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0);
+      if (base == MAP_FAILED)
+      {
+        LOG_ERR("mmap (reserve) failed");
+        ::close(fh);
+        return false;
+      }
+    }
+
+    // read-write files have a larger capacity than data. only read in the data.
+    int flags = MAP_SHARED | ((hints.populate && capacity == size) ? MAP_POPULATE : 0) | (base ? MAP_FIXED : 0);
+    void *ptr = mmap(base, capacity, PROT_READ | (readonly ? 0 : PROT_WRITE), flags, fh, 0);
     if (ptr == MAP_FAILED)
     {
       LOG_ERR("mmap failed");
+      if (base) munmap(base, reserved);
       ::close(fh);
       return false;
     }
+    _reserved = reserved;
+    _hints = hints;
+    apply_hints(ptr, capacity);
+    if (hints.populate && capacity != size && size > 0)
+    {
+      madvise(ptr, size, MADV_WILLNEED);
+    }
 
     _fh = fh;
     _size = size;
     _capa = capacity;
     _readonly = readonly;
     _ptr = ptr;
+    _flushed = size;
+    _sync_mark = size;
+    _sync_from = size;
+    _synced = size;
+    _low_write = (size_t)-1;
+    _published = size;
 
     return true;
   }
@@ -126,12 +287,14 @@ public:
   {
     if (_ptr)
     {
-      munmap(_ptr, _capa);
+      munmap(_ptr, _reserved ? _reserved : _capa);
       _ptr = NULL;
+      _reserved = 0;
     }
     if (_fh != -1)
     {
-      if (!_readonly)
+      // preallocated space is kept for the next open
+      if (!_readonly && !_hints.preallocate)
       {
         if (ftruncate(_fh, _size) != 0)
         {
@@ -156,18 +319,60 @@ public:
       return false;
     }
 
-    int err = ftruncate(_fh, new_capa); 
+    if (_reserved && new_capa > _reserved)
+    {
+      LOG_ERR("expand: reserved address space exhausted");
+      return false;
+    }
+
+    int err = resize(_fh, _capa, new_capa, _hints.preallocate); 
     if (err != 0)
     {
       LOG_ERR("expand: ftruncate failed");
       return false;
     }
 
+    if (_reserved)
+    {
+      /*
+       * Map the new extent behind the current one. The partial last page is
+       * mapped again, to the same file page.
+       */
+      size_t from = page_align(_capa);
+      void *ptr = mmap(((char*)_ptr) + from, new_capa - from, PROT_READ | PROT_WRITE, MAP_SHARED|MAP_FIXED, _fh, from);
+      if (ptr == MAP_FAILED)
+      {
+        LOG_ERR("expand: mmap (fixed) failed");
+        return false;
+      }
+      apply_hints(ptr, new_capa - from);
+      _capa = new_capa;
+      return true;
+    }
+
     /*
      * Try first to remap without holding the write_lock
      */
     void *ptr = mremap(_ptr, _capa, new_capa, 0);
-    if (ptr == MAP_FAILED)
+    if (ptr == MAP_FAILED && _epochs)
+    {
+      /*
+       * Map the file again elsewhere (both mappings share the same pages)
+       * and publish the new mapping. The old one is unmapped once the
+       * readers that might still use it are gone.
+       */
+      ptr = mmap(NULL, new_capa, PROT_READ | PROT_WRITE, MAP_SHARED, _fh, 0);
+      if (ptr == MAP_FAILED)
+      {
+        LOG_ERR("expand: mmap failed");
+        return false;
+      }
+      apply_hints(ptr, new_capa);
+      void *old = _ptr;
+      __atomic_store_n(&_ptr, ptr, __ATOMIC_RELEASE);
+      _epochs->retire(old, _capa);
+    }
+    else if (ptr == MAP_FAILED)
     {
       /*
        * Remapping failed. Try to munmap and mmap again, which
@@ -190,10 +395,12 @@ public:
 
       err = pthread_rwlock_unlock(_rwlock); 
       assert(!err);
+      apply_hints(ptr, new_capa);
     }
     else
     {
       assert(_ptr == ptr);
+      apply_hints(((char*)ptr) + page_align(_capa), new_capa - page_align(_capa));
     }
 
     _capa = new_capa;
@@ -210,7 +417,14 @@ public:
     if (offset + length > _capa)
     {
       size_t new_capa = _capa;
-      while (new_capa < offset + length) new_capa *= 2;
+      while (new_capa < offset + length)
+      {
+        if (_hints.growth_cap > 0 && new_capa >= _hints.growth_cap)
+          new_capa += _hints.growth_cap;
+        else
+          new_capa *= 2;
+      }
+      if (_reserved && new_capa > _reserved) new_capa = std::max(_reserved, offset + length);
       if (!expand(new_capa))
       {
         LOG_ERR("ptr_write_at failed at expand");
@@ -221,6 +435,7 @@ public:
 
     _size = std::max(_size, offset + length);
     assert(_size <= _capa);
+    _low_write = std::min(_low_write, offset);
 
     return (void*)(((char*)_ptr) + offset);
   }
@@ -231,18 +446,64 @@ public:
   }
 
   template <typename T>
-  void append_value(const T& value)
+  bool append_value(const T& value)
+  {
+    T *ptr = (T*)ptr_append(sizeof(T));
+    if (!ptr) return false;
+    *ptr = value;
+    return true;
+  }
+
+  /*
+   * Reserves "length" bytes at the end of the file and returns their
+   * "offset", so that several writers can append at the same time: the
+   * reservations are made one after the other (by the caller), while the
+   * data is filled in via ptr_reserved() concurrently. The data is not
+   * flushed before publish() covers it.
+   */
+  bool reserve(size_t length, size_t &offset)
   {
-    *((T*)ptr_append(sizeof(T))) = value;
+    offset = _size;
+    return ptr_write_at(offset, length) != NULL;
+  }
+
+  /*
+   * Undoes the reservations behind "size" (which were not published).
+   */
+  void truncate(size_t size)
+  {
+    assert(size >= _published && size <= _size);
+    _size = size;
+  }
+
+  /*
+   * Only valid while the caller keeps the mapping from being unmapped
+   * (pinned epoch), as a concurrent reserve() might move it.
+   */
+  inline void *ptr_reserved(size_t offset)
+  {
+    return ((char*)__atomic_load_n(&_ptr, __ATOMIC_ACQUIRE)) + offset;
+  }
+
+  /*
+   * Declares the data up to "end" as complete. Must be called by the writer
+   * (or synchronized with it).
+   */
+  void publish(size_t end)
+  {
+    assert(end >= _published && end <= _size);
+    _published = end;
   }
 
   inline const void *ptr_read_at(size_t offset, size_t length)
   {
-    assert(_ptr);
+    // expand() might publish a new mapping concurrently
+    char *ptr = (char*)__atomic_load_n(&_ptr, __ATOMIC_ACQUIRE);
+    assert(ptr);
     if (offset + length > _size)
       return NULL;
 
-    return (const void*)(((char*)_ptr) + offset);
+    return (const void*)(ptr + offset);
   }
 
   template <typename T>
@@ -257,29 +518,74 @@ public:
   }
  
   /*
-   * Potential very expensive operation!
-   *
-   * Flushes all changes back to disk.
+   * Starts the writeback of the data published since the last call, without
+   * waiting for it. Called by the writer, so that sync() finds little left
+   * to do.
+   */
+  void flush_async()
+  {
+    assert(!_readonly);
+    if (_published <= _flushed) return;
+
+    size_t from = page_align(_flushed);
+#ifdef SYNC_FILE_RANGE_WRITE
+    sync_file_range(_fh, from, _published - from, SYNC_FILE_RANGE_WRITE);
+#else
+    msync(((char*)_ptr) + from, _published - from, MS_ASYNC);
+#endif
+    _flushed = _published;
+  }
+
+  /*
+   * Remembers the range written since the last sync() for the next sync().
+   * Must be called by the writer (or synchronized with it), while sync() can
+   * run concurrently to appends, as long as the caller holds the read lock.
+   * Calls of mark_sync() and sync() must not overlap. Only the published
+   * data is covered, as the reserved space behind it might still be filled.
+   */
+  void mark_sync()
+  {
+    _sync_mark = _published;
+    _sync_from = std::min(_synced, _low_write);
+    _low_write = (size_t)-1;
+  }
+
+  /*
+   * Flushes the changes up to the last mark_sync() back to disk. As we
+   * mostly append, only the range written since the last successful sync()
+   * is flushed, so the cost does not grow with the size of the file.
    */
   bool sync()
   {
     int err;
-    err = msync(_ptr, _size, MS_SYNC);
+    if (_sync_from >= _sync_mark)
+    {
+      _synced = _sync_mark;
+      return true;
+    }
+
+    size_t from = page_align(_sync_from);
+    char *ptr = (char*)__atomic_load_n(&_ptr, __ATOMIC_ACQUIRE);
+    err = msync(ptr + from, _sync_mark - from, MS_SYNC);
     if (err != 0)
     {
       LOG_ERR("sync: msync failed");
       LOG_ERR(strerror(errno));
+      _synced = _sync_from;
       return false;
     }
 
-    err = fsync(_fh);
+    // also flushes the file size if it changed
+    err = fdatasync(_fh);
     if (err != 0)
     {
-      LOG_ERR("sync: fsync failed");
+      LOG_ERR("sync: fdatasync failed");
       LOG_ERR(strerror(errno));
+      _synced = _sync_from;
       return false;
     }
 
+    _synced = _sync_mark;
     return true;
   }
 
@@ -1,4 +1,9 @@
 require 'mkmf'
 $LDFLAGS = CONFIG['LDFLAGS'] = CONFIG['LDFLAGS'].gsub('--no-undefined', '--allow-shlib-undefined')
 
+# optional NUMA placement of the mappings
+if have_header('numaif.h') && have_library('numa', 'mbind')
+  $defs << '-DHAVE_NUMA'
+end
+
 create_makefile('RecordModelMMDBExt') 
@@ -53,7 +53,7 @@ AutoFileReader* get_AutoFileReader(VALUE obj)
 
 
 static VALUE
-AutoFileReader__open(VALUE klass, VALUE path, VALUE bufsz)
+AutoFileReader__open(VALUE klass, VALUE path, VALUE bufsz, VALUE threads, VALUE readahead, VALUE async, VALUE cache_mode)
 {
   Check_Type(path, T_STRING);
 
@@ -63,7 +63,28 @@ AutoFileReader__open(VALUE klass, VALUE path, VALUE bufsz)
     return Qnil;
   }
 
-  bool ok = reader->open(RSTRING_PTR(path), NUM2ULONG(bufsz)); 
+  bool ok = reader->open(RSTRING_PTR(path), NUM2ULONG(bufsz), NUM2UINT(threads), NUM2UINT(readahead),
+                         NUM2UINT(async), NUM2INT(cache_mode));
+  if (!ok)
+  {
+    delete reader;
+    return Qnil;
+  }
+
+  obj = Data_Wrap_Struct(klass, NULL, AutoFileReader__free, reader);
+  return obj;
+}
+
+static VALUE
+AutoFileReader__open_fd(VALUE klass, VALUE fd, VALUE bufsz, VALUE readahead)
+{
+  VALUE obj = Qnil;
+  AutoFileReader *reader = new AutoFileReader();
+  if (!reader) {
+    return Qnil;
+  }
+
+  bool ok = reader->open_fd(NUM2INT(fd), NUM2ULONG(bufsz), NUM2UINT(readahead));
   if (!ok)
   {
     delete reader;
@@ -1086,9 +1107,20 @@ extern "C"
 void Init_RecordModelExt()
 {
   cAutoFileReader = rb_define_class("AutoFileReader", rb_cObject);
-  rb_define_singleton_method(cAutoFileReader, "_open", (VALUE (*)(...)) AutoFileReader__open, 2);
+  rb_define_singleton_method(cAutoFileReader, "_open", (VALUE (*)(...)) AutoFileReader__open, 6);
+  rb_define_singleton_method(cAutoFileReader, "_open_fd", (VALUE (*)(...)) AutoFileReader__open_fd, 3);
   rb_define_method(cAutoFileReader, "close", (VALUE (*)(...)) AutoFileReader_close, 0);
   rb_define_method(cAutoFileReader, "read", (VALUE (*)(...)) AutoFileReader_read, 1);
+#ifdef HAVE_ZSTD
+  rb_define_const(cAutoFileReader, "HAVE_ZSTD", Qtrue);
+#else
+  rb_define_const(cAutoFileReader, "HAVE_ZSTD", Qfalse);
+#endif
+#ifdef HAVE_LZ4
+  rb_define_const(cAutoFileReader, "HAVE_LZ4", Qtrue);
+#else
+  rb_define_const(cAutoFileReader, "HAVE_LZ4", Qfalse);
+#endif
   
 
   cRecordModel = rb_define_class("RecordModel", rb_cObject);
@@ -2,4 +2,13 @@ require 'mkmf'
 
 have_library('z') || raise
 have_library('lzma') || raise
+
+# optional input formats
+if have_header('zstd.h') && have_library('zstd', 'ZSTD_decompressStream')
+  $defs << '-DHAVE_ZSTD'
+end
+if have_header('lz4frame.h') && have_library('lz4', 'LZ4F_decompress')
+  $defs << '-DHAVE_LZ4'
+end
+
 create_makefile('RecordModelExt')
@@ -0,0 +1,284 @@
+#ifndef __ASYNC_FILE_READER__HEADER__
+#define __ASYNC_FILE_READER__HEADER__
+
+#include "FileReader.h"
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h> // posix_memalign, free
+#include <string.h> // memcpy
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h> // pread
+#include <assert.h>
+
+/*
+ * Reads a regular file with several large pread()s in flight, issued by a
+ * pool of worker threads, while read() returns the data in order.
+ *
+ * The cache mode controls the page cache footprint of bulk reads, so that
+ * e.g. an import does not evict the pages serving MMDB queries:
+ *
+ *   CACHE_NORMAL:   plain reads (with POSIX_FADV_SEQUENTIAL).
+ *   CACHE_DONTNEED: drops the pages of each chunk once it was consumed.
+ *   CACHE_DIRECT:   bypasses the page cache with O_DIRECT. Falls back to
+ *                   CACHE_DONTNEED if the filesystem does not support it.
+ */
+class AsyncFileReader : public FileReader
+{
+  public:
+
+    static const int CACHE_NORMAL = 0;
+    static const int CACHE_DONTNEED = 1;
+    static const int CACHE_DIRECT = 2;
+
+  private:
+
+    static const size_t ALIGN = 4096; // for O_DIRECT
+
+    struct Chunk
+    {
+      char *data;
+      ssize_t len; // < 0 error
+      bool done;
+    };
+
+    int fd;
+    int cache_mode;
+    uint64_t file_size;
+    size_t chunk_size;
+    uint64_t num_chunks;
+
+    Chunk *ring;
+    size_t inflight;
+    // chunk indices: [head, issued) in flight or done. grow monotonically.
+    uint64_t head;
+    uint64_t issued;
+    size_t out_pos; // read position within chunk "head"
+    bool stopping;
+
+    pthread_t *threads;
+    unsigned num_threads;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+
+    inline Chunk &slot(uint64_t i) { return ring[i % inflight]; }
+
+    static void *worker_main(void *ptr)
+    {
+      ((AsyncFileReader*)ptr)->worker();
+      return NULL;
+    }
+
+    void worker()
+    {
+      pthread_mutex_lock(&mutex);
+      while (!stopping)
+      {
+        if (issued < num_chunks && issued - head < inflight)
+        {
+          uint64_t i = issued++;
+          Chunk &c = slot(i);
+          c.done = false;
+          pthread_mutex_unlock(&mutex);
+
+          c.len = read_chunk(c.data, i * chunk_size);
+
+          pthread_mutex_lock(&mutex);
+          c.done = true;
+          pthread_cond_broadcast(&cond);
+        }
+        else
+        {
+          pthread_cond_wait(&cond, &mutex);
+        }
+      }
+      pthread_mutex_unlock(&mutex);
+    }
+
+    ssize_t read_chunk(char *buf, uint64_t offset)
+    {
+      size_t want = chunk_size;
+      if (offset + want > file_size) want = file_size - offset;
+      // O_DIRECT needs an aligned length. the kernel stops at the file end.
+      size_t req = (cache_mode == CACHE_DIRECT) ? chunk_size : want;
+
+      size_t got = 0;
+      while (got < want)
+      {
+        ssize_t n = ::pread(fd, buf + got, req - got, offset + got);
+        if (n < 0)
+        {
+          if (errno == EINTR) continue;
+          return -1;
+        }
+        if (n == 0) break; // truncated since open()
+        got += n;
+      }
+      return (got > want) ? want : got;
+    }
+
+  public:
+
+    AsyncFileReader()
+    {
+      fd = -1;
+      ring = NULL;
+      threads = NULL;
+    }
+
+    /*
+     * Keeps up to "inflight" reads of "chunk_size" bytes in flight. Returns
+     * false for non-regular files (use PosixFileReader then).
+     */
+    bool open(const char *path, unsigned inflight = 4, size_t chunk_size = 1L << 20, int cache_mode = CACHE_NORMAL)
+    {
+      assert(fd == -1);
+      assert(inflight > 0);
+
+      this->cache_mode = cache_mode;
+      if (cache_mode == CACHE_DIRECT)
+      {
+        fd = ::open(path, O_RDONLY | O_DIRECT);
+        if (fd == -1 && errno == EINVAL)
+          this->cache_mode = CACHE_DONTNEED;
+      }
+      if (fd == -1)
+        fd = ::open(path, O_RDONLY);
+      if (fd == -1)
+        return false;
+
+      struct stat st;
+      if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode))
+      {
+        ::close(fd); fd = -1;
+        return false;
+      }
+      file_size = st.st_size;
+
+      if (this->cache_mode != CACHE_DIRECT)
+        posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+      chunk_size = (chunk_size + ALIGN - 1) & ~(ALIGN - 1);
+      if (chunk_size == 0) chunk_size = ALIGN;
+      this->chunk_size = chunk_size;
+      this->num_chunks = (file_size + chunk_size - 1) / chunk_size;
+      this->inflight = inflight;
+
+      ring = (Chunk*)malloc(sizeof(Chunk) * inflight);
+      threads = (pthread_t*)malloc(sizeof(pthread_t) * inflight);
+      if (!ring || !threads)
+        goto fail;
+      for (size_t i = 0; i < inflight; ++i) ring[i].data = NULL;
+      for (size_t i = 0; i < inflight; ++i)
+      {
+        if (posix_memalign((void**)&ring[i].data, ALIGN, chunk_size) != 0)
+        {
+          ring[i].data = NULL;
+          goto fail;
+        }
+      }
+
+      head = issued = 0;
+      out_pos = 0;
+      stopping = false;
+
+      pthread_mutex_init(&mutex, NULL);
+      pthread_cond_init(&cond, NULL);
+
+      num_threads = 0;
+      for (unsigned i = 0; i < inflight; ++i)
+      {
+        if (pthread_create(&threads[i], NULL, worker_main, this) != 0)
+          break;
+        ++num_threads;
+      }
+      if (num_threads == 0)
+      {
+        pthread_cond_destroy(&cond);
+        pthread_mutex_destroy(&mutex);
+        goto fail;
+      }
+
+      return true;
+
+    fail:
+      if (ring)
+      {
+        for (size_t i = 0; i < inflight; ++i) free(ring[i].data);
+        free(ring); ring = NULL;
+      }
+      free(threads); threads = NULL;
+      ::close(fd); fd = -1;
+      return false;
+    }
+
+    virtual void close()
+    {
+      assert(fd >= 0);
+
+      pthread_mutex_lock(&mutex);
+      stopping = true;
+      pthread_cond_broadcast(&cond);
+      pthread_mutex_unlock(&mutex);
+      for (unsigned i = 0; i < num_threads; ++i)
+      {
+        pthread_join(threads[i], NULL);
+      }
+
+      pthread_cond_destroy(&cond);
+      pthread_mutex_destroy(&mutex);
+
+      for (size_t i = 0; i < inflight; ++i) free(ring[i].data);
+      free(ring); ring = NULL;
+      free(threads); threads = NULL;
+
+      ::close(fd);
+      fd = -1;
+    }
+
+    virtual ssize_t read(void *buf, size_t buflen)
+    {
+      assert(fd >= 0);
+
+      pthread_mutex_lock(&mutex);
+      if (head == num_chunks)
+      {
+        pthread_mutex_unlock(&mutex);
+        return 0;
+      }
+      while (head == issued || !slot(head).done)
+      {
+        pthread_cond_wait(&cond, &mutex);
+      }
+      Chunk &c = slot(head);
+      pthread_mutex_unlock(&mutex);
+
+      if (c.len < 0)
+        return -1;
+
+      size_t n = c.len - out_pos;
+      if (n > buflen) n = buflen;
+      memcpy(buf, c.data + out_pos, n);
+      out_pos += n;
+
+      if (out_pos == (size_t)c.len)
+      {
+        if (cache_mode == CACHE_DONTNEED)
+          posix_fadvise(fd, head * chunk_size, c.len, POSIX_FADV_DONTNEED);
+
+        out_pos = 0;
+        pthread_mutex_lock(&mutex);
+        // a short chunk means the file was truncated. treat as end.
+        if ((size_t)c.len < chunk_size) num_chunks = head + 1;
+        ++head;
+        pthread_cond_broadcast(&cond);
+        pthread_mutex_unlock(&mutex);
+      }
+
+      return n;
+    }
+};
+
+#endif
@@ -3,23 +3,131 @@
 
 #include "FileReader.h"
 #include "PosixFileReader.h"
+#include "AsyncFileReader.h"
+#include "FdFileReader.h"
+#include "PeekFileReader.h"
 #include "GzipFileReader.h"
 #include "XzFileReader.h"
+#include "ReadAheadFileReader.h"
+#ifdef HAVE_ZSTD
+#include "ZstdFileReader.h"
+#endif
+#ifdef HAVE_LZ4
+#include "Lz4FileReader.h"
+#endif
 #include <assert.h>
-#include <string.h> // strlen
-#include <strings.h> // strncasecmp
+#include <string.h> // memcmp
 
 /*
- * Depending on the filename suffix uses a different FileReader.
+ * Selects the FileReader by the magic bytes at the start of the input
+ * (gzip, xz, and if compiled in, Zstandard and LZ4), otherwise reads the
+ * input as is. The first block is peeked at and then returned again
+ * (PeekFileReader), so this also works for pipes (open_fd()).
+ *
+ * Optionally, the selected FileReader is run on a separate thread
+ * (ReadAheadFileReader), so that decompression overlaps with the consumer.
  */
 class AutoFileReader : public FileReader
 {
   PosixFileReader p_fr;
+  AsyncFileReader async_fr;
+  FdFileReader fd_fr;
+  PeekFileReader peek_fr;
   GzipFileReader gz_fr;
   XzFileReader xz_fr;
+  ReadAheadFileReader ra_fr;
+#ifdef HAVE_ZSTD
+  ZstdFileReader zstd_fr;
+#endif
+#ifdef HAVE_LZ4
+  Lz4FileReader lz4_fr;
+#endif
 
   FileReader *file;
 
+  enum Format { FMT_RAW, FMT_GZIP, FMT_XZ, FMT_ZSTD, FMT_LZ4 };
+
+  static Format detect_format(const char *p, size_t len)
+  {
+    if (len >= 3 && memcmp(p, "\x1f\x8b\x08", 3) == 0) return FMT_GZIP;
+    if (len >= 6 && memcmp(p, "\xfd" "7zXZ\x00", 6) == 0) return FMT_XZ;
+    if (len >= 4 && memcmp(p, "\x28\xb5\x2f\xfd", 4) == 0) return FMT_ZSTD;
+    if (len >= 4 && memcmp(p, "\x04\x22\x4d\x18", 4) == 0) return FMT_LZ4;
+    return FMT_RAW;
+  }
+
+  /*
+   * "path" is NULL for non-file sources. Otherwise it is used to reopen
+   * the file for parallel decoding, which needs random access.
+   */
+  bool open_source(FileReader *source, const char *path, unsigned bufsize, unsigned threads, unsigned readahead)
+  {
+    if (!peek_fr.open(source, bufsize))
+    {
+      source->close();
+      return false;
+    }
+
+    Format fmt = detect_format(peek_fr.peek(), peek_fr.peek_len());
+    bool reopen = (path != NULL && threads > 1 && fmt != FMT_RAW);
+    if (reopen)
+    {
+      peek_fr.close();
+    }
+
+    bool ok = false;
+    switch (fmt)
+    {
+      case FMT_GZIP:
+        ok = reopen ? gz_fr.open(path, bufsize, threads) : gz_fr.open(&peek_fr, bufsize);
+        file = &gz_fr;
+        break;
+      case FMT_XZ:
+        ok = reopen ? xz_fr.open(path, bufsize, threads) : xz_fr.open(&peek_fr, bufsize);
+        file = &xz_fr;
+        break;
+#ifdef HAVE_ZSTD
+      case FMT_ZSTD:
+        ok = reopen ? zstd_fr.open(path, bufsize, threads) : zstd_fr.open(&peek_fr, bufsize);
+        file = &zstd_fr;
+        break;
+#endif
+#ifdef HAVE_LZ4
+      case FMT_LZ4:
+        ok = reopen ? lz4_fr.open(path, bufsize, threads) : lz4_fr.open(&peek_fr, bufsize);
+        file = &lz4_fr;
+        break;
+#endif
+      case FMT_RAW:
+        ok = true;
+        file = &peek_fr;
+        break;
+      default:
+        // compressed, but support not compiled in
+        break;
+    }
+
+    if (!ok)
+    {
+      // a failed open() leaves its source to us
+      if (!reopen) peek_fr.close();
+      file = NULL;
+      return false;
+    }
+
+    if (readahead > 0)
+    {
+      if (!ra_fr.open(file, readahead, bufsize))
+      {
+        file->close(); file = NULL;
+        return false;
+      }
+      file = &ra_fr;
+    }
+
+    return true;
+  }
+
   public:
 
     AutoFileReader()
@@ -27,29 +135,38 @@ class AutoFileReader : public FileReader
       file = NULL;
     }
 
-    bool open(const char *path, unsigned bufsize = 1L << 16)
+    /*
+     * "threads" > 1 enables parallel decoding for formats that support it.
+     *
+     * "readahead" > 0 reads ahead on a producer thread into that many buffers
+     * of "bufsize" bytes.
+     *
+     * "async" > 0 reads regular files with that many reads of "async_chunk"
+     * bytes in flight (AsyncFileReader), using "cache_mode". This applies to
+     * uncompressed files and serial decoding.
+     */
+    bool open(const char *path, unsigned bufsize = 1L << 16, unsigned threads = 0, unsigned readahead = 0,
+              unsigned async = 0, int cache_mode = AsyncFileReader::CACHE_NORMAL, size_t async_chunk = 1L << 20)
     {
       assert(file == NULL);
 
-      int slen = strlen(path);
+      if (async > 0 && async_fr.open(path, async, async_chunk, cache_mode))
+        return open_source(&async_fr, path, bufsize, threads, readahead);
 
-      if (slen >= 3 && strncasecmp(&path[slen-3], ".xz", 3) == 0)
-      {
-        if (!xz_fr.open(path, bufsize)) return false; 
-	file = &xz_fr;
-      }
-      else if (slen >= 3 && strncasecmp(&path[slen-3], ".gz", 3) == 0)
-      {
-        if (!gz_fr.open(path, bufsize)) return false;
-	file = &gz_fr;
-      }
-      else
-      {
-        if (!p_fr.open(path)) return false;
-	file = &p_fr;
-      }
+      if (!p_fr.open(path)) return false;
+      return open_source(&p_fr, path, bufsize, threads, readahead);
+    }
+
+    /*
+     * Like open(), but reads from a file descriptor (e.g. a pipe), which is
+     * not closed by close(). Decoding is always serial.
+     */
+    bool open_fd(int fd, unsigned bufsize = 1L << 16, unsigned readahead = 0)
+    {
+      assert(file == NULL);
 
-      return true;
+      if (!fd_fr.open(fd)) return false;
+      return open_source(&fd_fr, NULL, bufsize, 0, readahead);
     }
 
     virtual void close()
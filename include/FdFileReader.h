@@ -3,6 +3,8 @@
 
 #include "FileReader.h"
 #include <unistd.h>
+#include <errno.h>
+#include <poll.h>
 #include <assert.h>
 
 /*
@@ -42,7 +44,19 @@ class FdFileReader : public FileReader
     virtual ssize_t read(void *buf, size_t buflen)
     {
       assert(fd >= 0);
-      return ::read(fd, buf, buflen);
+      for (;;)
+      {
+        ssize_t n = ::read(fd, buf, buflen);
+        if (n >= 0) return n;
+        if (errno == EINTR) continue;
+        if (errno != EAGAIN && errno != EWOULDBLOCK) return n;
+
+        // non-blocking fd (Ruby sets O_NONBLOCK on pipes). wait for data.
+        struct pollfd pfd;
+        pfd.fd = fd;
+        pfd.events = POLLIN;
+        if (poll(&pfd, 1, -1) < 0 && errno != EINTR) return -1;
+      }
     }
 };
 
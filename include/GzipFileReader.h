@@ -2,23 +2,413 @@
 #define __GZIP_FILE_READER__HEADER__
 
 #include "FileReader.h"
+#include "ParallelBlockReader.h"
 #include <zlib.h>
 #include <assert.h>
+#include <stdlib.h> // malloc, realloc
+#include <string.h> // memchr
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h> // pread, lseek
+
+/*
+ * Decodes files consisting of many concatenated gzip members (e.g. bgzf, or
+ * producers writing one member per chunk) in parallel.
+ *
+ * Gzip has no index, so member boundaries are guessed: A block starts at a
+ * member boundary and ends at the first plausible gzip member header found
+ * after at least CHUNK_SIZE bytes. The worker decoding a block checks that its
+ * last member ends exactly at the end of the block (members are CRC
+ * protected, so a wrong guess fails to decode). If it does not, the worker
+ * keeps decoding that member past the end of the block. The blocks queued
+ * behind it are then dropped and enumeration restarts at the real member
+ * boundary (see in_sequence()).
+ *
+ * A block that decodes to more than MAX_BLOCK_SIZE bytes (e.g. a long member
+ * spanning a wrongly guessed boundary) is not decoded in parallel. Reading
+ * then continues serially with gzread() from the start of that block.
+ */
+class GzipParallelReader : public ParallelBlockReader
+{
+  int fd;
+  uint64_t file_size;
+  uint64_t next_offset;     // where next_block() continues
+  uint64_t expected_offset; // where the next in-sequence block starts
+  uint64_t serial_offset;   // continue serially from here (or UINT64_MAX)
+  gzFile serial;
+
+  static const uint64_t CHUNK_SIZE = 1L << 20;
+  static const uint64_t MAX_BLOCK_SIZE = 1ULL << 30;
+  static const uint64_t TOO_LARGE = 1; // Block::user
+  static const size_t SCAN_BUF_SIZE = 1L << 16;
+  static const size_t READ_SIZE = 1L << 20;
+
+  /*
+   * ID1 ID2 CM FLG MTIME(4) XFL OS. Reserved flags must be zero, and we
+   * only accept the usual values for XFL and OS to make false positives
+   * within compressed data unlikely.
+   */
+  static bool is_member_header(const uint8_t *p)
+  {
+    return (p[0] == 0x1f && p[1] == 0x8b && p[2] == 8 &&
+            (p[3] & 0xE0) == 0 &&
+            (p[8] == 0 || p[8] == 2 || p[8] == 4) &&
+            (p[9] <= 13 || p[9] == 255));
+  }
+
+  /*
+   * Returns the offset of the first member header at or after "from" (and
+   * before "limit"), or file_size if there is none.
+   */
+  uint64_t find_member(uint64_t from, uint64_t limit)
+  {
+    const size_t HDR = 10;
+    uint8_t buf[SCAN_BUF_SIZE];
+
+    if (limit > file_size) limit = file_size;
+
+    while (from + HDR <= limit)
+    {
+      size_t len = SCAN_BUF_SIZE;
+      if (from + len > limit) len = limit - from;
+      if (!pread_full(fd, buf, len, from))
+        return file_size;
+
+      const uint8_t *p = buf;
+      const uint8_t *end = buf + len - HDR + 1;
+      while (p < end && (p = (const uint8_t*)memchr(p, 0x1f, end - p)) != NULL)
+      {
+        if (is_member_header(p))
+          return from + (p - buf);
+        ++p;
+      }
+      // the last HDR-1 bytes could be the start of a header
+      from += len - HDR + 1;
+    }
+
+    return file_size;
+  }
+
+  protected:
+
+    virtual bool next_block(Block &b)
+    {
+      if (next_offset >= file_size)
+        return false;
+
+      b.offset = next_offset;
+      uint64_t end = find_member(next_offset + CHUNK_SIZE, UINT64_MAX);
+      b.in_size = end - next_offset;
+      next_offset = end;
+      return true;
+    }
+
+    /*
+     * Sets b.in_size to the number of bytes actually consumed.
+     */
+    virtual bool decode_block(Block &b)
+    {
+      if (b.in_size > MAX_BLOCK_SIZE)
+      {
+        b.user = TOO_LARGE;
+        return false;
+      }
+
+      size_t in_capa = b.in_size;
+      uint8_t *in = (uint8_t*)malloc(in_capa);
+      if (!in) return false;
+      if (!pread_full(fd, in, b.in_size, b.offset))
+      {
+        free(in);
+        return false;
+      }
+
+      size_t out_capa = 4*b.in_size;
+      if (out_capa > MAX_BLOCK_SIZE) out_capa = MAX_BLOCK_SIZE;
+      b.out = malloc(out_capa);
+      if (!b.out)
+      {
+        free(in);
+        return false;
+      }
+
+      z_stream z;
+      memset(&z, 0, sizeof(z));
+      if (inflateInit2(&z, 16 + MAX_WBITS) != Z_OK)
+      {
+        free(in);
+        return false;
+      }
+
+      bool ok = false;
+      uint64_t in_len = b.in_size; // bytes in "in"
+      uint64_t consumed = 0;       // up to the end of the last complete member
+      z.next_in = in;
+      z.avail_in = in_len;
+
+      for (;;)
+      {
+        if (b.out_len == out_capa)
+        {
+          if (out_capa == MAX_BLOCK_SIZE)
+          {
+            b.user = TOO_LARGE;
+            break;
+          }
+          size_t capa = 2*out_capa;
+          if (capa > MAX_BLOCK_SIZE) capa = MAX_BLOCK_SIZE;
+          void *p = realloc(b.out, capa);
+          if (!p) break;
+          b.out = p;
+          out_capa = capa;
+        }
+        z.next_out = ((Bytef*)b.out) + b.out_len;
+        z.avail_out = out_capa - b.out_len;
+
+        int ret = inflate(&z, Z_NO_FLUSH);
+        b.out_len = out_capa - z.avail_out;
+
+        if (ret == Z_STREAM_END)
+        {
+          consumed = in_len - z.avail_in;
+          if (consumed >= b.in_size)
+          {
+            // the member ended exactly at (or beyond) the end of the block
+            ok = true;
+            break;
+          }
+          if (z.avail_in < 10 || !is_member_header(z.next_in))
+          {
+            // trailing garbage. only acceptable at the end of the file.
+            ok = (b.offset + b.in_size == file_size);
+            break;
+          }
+          inflateReset(&z);
+        }
+        else if (ret == Z_BUF_ERROR && z.avail_in == 0)
+        {
+          /*
+           * The member continues beyond the end of the block (we guessed the
+           * boundary wrong). Read more input.
+           */
+          uint64_t pos = b.offset + in_len;
+          if (pos >= file_size)
+            break; // truncated file
+
+          size_t n = READ_SIZE;
+          if (pos + n > file_size) n = file_size - pos;
+          uint8_t *p = (uint8_t*)realloc(in, in_len + n);
+          if (!p) break;
+          in = p;
+          if (!pread_full(fd, in + in_len, n, pos)) break;
+          z.next_in = in + in_len;
+          z.avail_in = n;
+          in_len += n;
+        }
+        else if (ret != Z_OK && ret != Z_BUF_ERROR)
+        {
+          break;
+        }
+      }
+
+      inflateEnd(&z);
+      free(in);
+
+      if (ok && consumed > b.in_size)
+        b.in_size = consumed;
+      return ok;
+    }
+
+    virtual bool in_sequence(Block &b)
+    {
+      if (b.offset != expected_offset)
+        return false;
+      if (b.user == TOO_LARGE)
+        serial_offset = b.offset; // read() fails on this block
+      expected_offset = b.offset + b.in_size;
+      return true;
+    }
+
+    virtual void resync()
+    {
+      next_offset = expected_offset;
+    }
+
+  public:
+
+    GzipParallelReader()
+    {
+      fd = -1;
+      serial = NULL;
+    }
+
+    /*
+     * Returns false for files with a single member (or if we think so
+     * because there is no other member header within the first
+     * 16*CHUNK_SIZE bytes). Use gzread() then.
+     */
+    bool open(const char *path, unsigned threads)
+    {
+      assert(fd == -1);
+
+      fd = ::open(path, O_RDONLY);
+      if (fd == -1)
+        return false;
+
+      struct stat st;
+      uint8_t hdr[10];
+      if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode))
+        goto fail;
+
+      file_size = st.st_size;
+      if (file_size < sizeof(hdr) || !pread_full(fd, hdr, sizeof(hdr), 0) || !is_member_header(hdr))
+        goto fail;
+
+      if (find_member(sizeof(hdr), 16*CHUNK_SIZE) == file_size)
+        goto fail;
+
+      next_offset = 0;
+      expected_offset = 0;
+      serial_offset = UINT64_MAX;
+
+      if (!start(threads, 2*threads))
+        goto fail;
+
+      return true;
+
+    fail:
+      close();
+      return false;
+    }
+
+    virtual void close()
+    {
+      stop();
+      if (serial)
+      {
+        gzclose(serial); // closes "fd"
+        serial = NULL;
+        fd = -1;
+      }
+      if (fd != -1)
+      {
+        ::close(fd);
+        fd = -1;
+      }
+    }
+
+    virtual ssize_t read(void *buf, size_t buflen)
+    {
+      if (serial)
+        return gzread(serial, buf, buflen);
+      if (!running())
+        return -1;
+
+      ssize_t n = ParallelBlockReader::read(buf, buflen);
+      if (n >= 0 || serial_offset == UINT64_MAX)
+        return n;
+
+      // everything before the block that was too large has been returned
+      stop();
+      if (lseek(fd, serial_offset, SEEK_SET) == -1)
+        return -1;
+      serial = gzdopen(fd, "r");
+      if (!serial)
+        return -1;
+      gzbuffer(serial, READ_SIZE);
+      return gzread(serial, buf, buflen);
+    }
+};
 
 class GzipFileReader : public FileReader
 {
   gzFile file;
+  GzipParallelReader par;
+  bool parallel;
+
+  // streaming from a FileReader (see open(FileReader*))
+  FileReader *source;
+  z_stream z;
+  Bytef *inbuf;
+  size_t bufsize;
+  bool is_eof;
+  bool member_end; // the last inflate() finished a member
+  bool done;       // eof, or trailing garbage after a member
+
+  /*
+   * Fills "inbuf" if it is empty. Returns false on error.
+   */
+  bool fill()
+  {
+    if (is_eof || z.avail_in > 0) return true;
+    ssize_t n = source->read(inbuf, bufsize);
+    if (n < 0) return false;
+    if (n == 0) is_eof = true;
+    z.next_in = inbuf;
+    z.avail_in = n;
+    return true;
+  }
+
+  ssize_t read_source(void *buf, size_t buflen)
+  {
+    while (!done)
+    {
+      if (!fill()) return -1;
+
+      if (member_end)
+      {
+        // like gzread(), ignore anything after a member that is not
+        // another member
+        if (z.avail_in == 0 || z.next_in[0] != 0x1f)
+        {
+          done = true;
+          break;
+        }
+        inflateReset(&z);
+        member_end = false;
+      }
+
+      if (is_eof && z.avail_in == 0)
+        return -1; // truncated member
+
+      z.next_out = (Bytef*)buf;
+      z.avail_out = buflen;
+      int ret = inflate(&z, Z_NO_FLUSH);
+      if (ret == Z_STREAM_END)
+        member_end = true;
+      else if (ret != Z_OK && ret != Z_BUF_ERROR)
+        return -1;
+
+      size_t len = buflen - z.avail_out;
+      if (len > 0) return len;
+    }
+    return 0;
+  }
 
   public:
 
     GzipFileReader()
     {
       file = NULL;
+      parallel = false;
+      source = NULL;
     }
 
-    bool open(const char *path, unsigned bufsize = 1L << 16)
+    /*
+     * With threads > 1, files consisting of multiple gzip members are decoded
+     * in parallel by GzipParallelReader. Single-member files use gzread().
+     */
+    bool open(const char *path, unsigned bufsize = 1L << 16, unsigned threads = 0)
     {
-      assert(file == NULL);
+      assert(file == NULL && !parallel && !source);
+
+      if (threads > 1 && par.open(path, threads))
+      {
+        parallel = true;
+        return true;
+      }
+
       file = gzopen(path, "r"); 
       if (file)
       {
@@ -31,14 +421,58 @@ class GzipFileReader : public FileReader
       }
     }
 
+    /*
+     * Decodes the data read from "source" (e.g. a pipe). close() also closes
+     * "source". If it fails, "source" is left open for the caller to close.
+     */
+    bool open(FileReader *source, unsigned bufsize = 1L << 16)
+    {
+      assert(file == NULL && !parallel && !this->source);
+
+      inbuf = (Bytef*)malloc(bufsize);
+      if (!inbuf) return false;
+
+      memset(&z, 0, sizeof(z));
+      if (inflateInit2(&z, 16 + MAX_WBITS) != Z_OK)
+      {
+        free(inbuf); inbuf = NULL;
+        return false;
+      }
+
+      this->source = source;
+      this->bufsize = bufsize;
+      is_eof = false;
+      member_end = false;
+      done = false;
+      return true;
+    }
+
     virtual void close()
     {
+      if (parallel)
+      {
+        par.close();
+        parallel = false;
+        return;
+      }
+      if (source)
+      {
+        inflateEnd(&z);
+        free(inbuf); inbuf = NULL;
+        source->close();
+        source = NULL;
+        return;
+      }
       assert(file);
       gzclose(file);
     }
 
     virtual ssize_t read(void *buf, size_t buflen)
     {
+      if (parallel)
+        return par.read(buf, buflen);
+      if (source)
+        return read_source(buf, buflen);
       assert(file);
       return gzread(file, buf, buflen);
     }
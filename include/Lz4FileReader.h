@@ -0,0 +1,309 @@
+#ifndef __LZ4_FILE_READER__HEADER__
+#define __LZ4_FILE_READER__HEADER__
+
+#include "FileReader.h"
+#include "PosixFileReader.h"
+#include "ParallelBlockReader.h"
+#include <lz4frame.h>
+#include <assert.h>
+#include <stdint.h>
+#include <stdlib.h> // malloc
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h> // pread
+
+/*
+ * Decodes the frames of a multi-frame .lz4 file in parallel. Frame boundaries
+ * are found by walking the block size fields of each frame.
+ */
+class Lz4ParallelReader : public ParallelBlockReader
+{
+  int fd;
+  uint64_t file_size;
+  uint64_t next_offset;
+
+  static const uint32_t MAGIC = 0x184D2204;
+
+  // see ParallelBlockReader::data_frame_fn
+  static bool data_frame_size(int fd, uint64_t file_size, uint64_t offset, const uint8_t *hdr, uint64_t &frame_size)
+  {
+    if (le32(hdr) != MAGIC)
+      return false;
+
+    // frame descriptor: FLG, BD, [content size], [dictionary id], HC
+    uint8_t flg = hdr[4];
+    if ((flg >> 6) != 1) return false; // version
+    bool block_checksum = (flg >> 4) & 1;
+    bool content_size = (flg >> 3) & 1;
+    bool content_checksum = (flg >> 2) & 1;
+    bool dict_id = flg & 1;
+    uint64_t pos = offset + 4 + 2 + (content_size ? 8 : 0) + (dict_id ? 4 : 0) + 1;
+
+    // blocks, terminated by a zero size (EndMark)
+    for (;;)
+    {
+      uint8_t bs[4];
+      if (pos + 4 > file_size || !pread_full(fd, bs, 4, pos))
+        return false;
+      uint32_t size = le32(bs) & 0x7FFFFFFF;
+      pos += 4;
+      if (size == 0) break;
+      pos += size + (block_checksum ? 4 : 0);
+    }
+    if (content_checksum) pos += 4;
+
+    frame_size = pos - offset;
+    return pos <= file_size;
+  }
+
+  protected:
+
+    virtual bool next_block(Block &b)
+    {
+      return next_frame(fd, file_size, next_offset, data_frame_size, b);
+    }
+
+    virtual bool decode_block(Block &b)
+    {
+      void *in = malloc(b.in_size);
+      if (!in) return false;
+      if (!pread_full(fd, in, b.in_size, b.offset))
+      {
+        free(in);
+        return false;
+      }
+
+      bool ok = false;
+      LZ4F_dctx *dctx = NULL;
+      if (LZ4F_isError(LZ4F_createDecompressionContext(&dctx, LZ4F_VERSION)))
+      {
+        free(in);
+        return false;
+      }
+
+      const char *src = (const char*)in;
+      size_t src_left = b.in_size;
+
+      // the frame header tells us the content size, if present
+      LZ4F_frameInfo_t info;
+      size_t consumed = src_left;
+      size_t out_capa = 4*b.in_size;
+      if (!LZ4F_isError(LZ4F_getFrameInfo(dctx, &info, src, &consumed)))
+      {
+        src += consumed;
+        src_left -= consumed;
+        if (info.contentSize > 0) out_capa = info.contentSize;
+      }
+      else
+      {
+        src_left = 0;
+      }
+
+      b.out = malloc(out_capa > 0 ? out_capa : 1);
+      if (b.out && src_left > 0)
+      {
+        for (;;)
+        {
+          if (b.out_len == out_capa)
+          {
+            void *p = realloc(b.out, 2*out_capa);
+            if (!p) break;
+            b.out = p;
+            out_capa *= 2;
+          }
+          size_t dst_size = out_capa - b.out_len;
+          size_t src_size = src_left;
+          size_t ret = LZ4F_decompress(dctx, ((char*)b.out) + b.out_len, &dst_size, src, &src_size, NULL);
+          if (LZ4F_isError(ret)) break;
+          b.out_len += dst_size;
+          src += src_size;
+          src_left -= src_size;
+          if (ret == 0)
+          {
+            ok = (src_left == 0);
+            break;
+          }
+          if (src_left == 0 && dst_size == 0)
+            break; // truncated
+        }
+      }
+
+      LZ4F_freeDecompressionContext(dctx);
+      free(in);
+      return ok;
+    }
+
+  public:
+
+    Lz4ParallelReader()
+    {
+      fd = -1;
+    }
+
+    /*
+     * Returns false if the file does not contain at least two data frames.
+     * Use the serial Lz4FileReader then.
+     */
+    bool open(const char *path, unsigned threads)
+    {
+      assert(fd == -1);
+
+      fd = ::open(path, O_RDONLY);
+      if (fd == -1)
+        return false;
+
+      struct stat st;
+      if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode))
+        goto fail;
+      file_size = st.st_size;
+
+      if (count_frames(fd, file_size, data_frame_size, 2) < 2)
+        goto fail;
+
+      next_offset = 0;
+      if (!start(threads, 2*threads))
+        goto fail;
+
+      return true;
+
+    fail:
+      close();
+      return false;
+    }
+
+    virtual void close()
+    {
+      stop();
+      if (fd != -1)
+      {
+        ::close(fd);
+        fd = -1;
+      }
+    }
+};
+
+class Lz4FileReader : public FileReader
+{
+  PosixFileReader pf;
+  Lz4ParallelReader par;
+  FileReader *file;
+  LZ4F_dctx *dctx;
+  char *inbuf;
+  size_t in_pos;
+  size_t in_len;
+  size_t bufsize;
+  bool is_eof;
+  size_t last_ret; // hint returned by LZ4F_decompress, 0 at a frame end
+
+  public:
+
+    Lz4FileReader()
+    {
+      file = NULL;
+      inbuf = NULL;
+      dctx = NULL;
+    }
+
+    /*
+     * With threads > 1, multi-frame files are decoded in parallel by
+     * Lz4ParallelReader.
+     */
+    bool open(const char *path, unsigned bufsize = 1L << 16, unsigned threads = 0)
+    {
+      assert(file == NULL);
+
+      if (threads > 1 && par.open(path, threads))
+      {
+        file = &par;
+        return true;
+      }
+
+      if (!pf.open(path))
+      {
+        return false;
+      }
+      if (!open(&pf, bufsize))
+      {
+        pf.close();
+        return false;
+      }
+      return true;
+    }
+
+    /*
+     * Decodes the data read from "source" (serially). close() also closes
+     * "source". If it fails, "source" is left open for the caller to close.
+     */
+    bool open(FileReader *source, unsigned bufsize = 1L << 16)
+    {
+      assert(file == NULL);
+      file = source;
+
+      this->inbuf = (char*)malloc(bufsize);
+      if (!inbuf || LZ4F_isError(LZ4F_createDecompressionContext(&dctx, LZ4F_VERSION)))
+      {
+        file = NULL;
+        free(inbuf); inbuf = NULL;
+        if (dctx) LZ4F_freeDecompressionContext(dctx);
+        dctx = NULL;
+        return false;
+      }
+      this->bufsize = bufsize;
+
+      in_pos = in_len = 0;
+      is_eof = false;
+      last_ret = 0;
+
+      return true;
+    }
+
+    virtual void close()
+    {
+      assert(file);
+      file->close();
+      if (file != &par)
+      {
+        free(inbuf); inbuf = NULL;
+        LZ4F_freeDecompressionContext(dctx); dctx = NULL;
+      }
+      file = NULL;
+    }
+
+    virtual ssize_t read(void *buf, size_t buflen)
+    {
+      assert(file);
+      if (file == &par)
+        return par.read(buf, buflen);
+
+      for (;;)
+      {
+        if (!is_eof && in_pos == in_len)
+        {
+          ssize_t n = file->read(this->inbuf, this->bufsize);
+          if (n < 0) return -1;
+          if (n == 0) is_eof = true;
+          in_len = n;
+          in_pos = 0;
+        }
+
+        if (is_eof && in_pos == in_len)
+        {
+          // a truncated frame is an error
+          return (last_ret == 0) ? 0 : -1;
+        }
+
+        size_t dst_size = buflen;
+        size_t src_size = in_len - in_pos;
+        last_ret = LZ4F_decompress(dctx, buf, &dst_size, inbuf + in_pos, &src_size, NULL);
+        if (LZ4F_isError(last_ret))
+          return -1;
+        in_pos += src_size;
+
+        if (dst_size > 0)
+          return dst_size;
+      }
+    }
+};
+
+#endif
@@ -0,0 +1,409 @@
+#ifndef __PARALLEL_BLOCK_READER__HEADER__
+#define __PARALLEL_BLOCK_READER__HEADER__
+
+#include "FileReader.h"
+#include <pthread.h>
+#include <stdint.h> // uint64_t
+#include <stdlib.h> // malloc, free
+#include <string.h> // memcpy
+#include <unistd.h> // pread
+#include <assert.h>
+
+/*
+ * Base class for compressed formats whose input consists of independently
+ * decodable blocks (e.g. xz blocks, gzip members).
+ *
+ * A pool of worker threads decodes up to "window" blocks ahead, while read()
+ * returns the decoded data strictly in input order.
+ *
+ * Subclasses implement:
+ *
+ *   next_block():   Fills in the next block of the input (offset and sizes).
+ *                   Called with the lock held, i.e. sequentially and in
+ *                   input order. Returns false at the end of the input.
+ *
+ *   decode_block(): Decodes a block into a malloc()ed "out" buffer and sets
+ *                   "out_len". Called concurrently from the worker threads
+ *                   without holding the lock. Returns false on error.
+ *
+ * Subclasses which have to guess block boundaries can additionally implement
+ * in_sequence() and resync() (see below). Formats made of frames (zstd,
+ * lz4) find them with next_frame().
+ */
+class ParallelBlockReader : public FileReader
+{
+  protected:
+
+    struct Block
+    {
+      uint64_t offset;   // file offset of the compressed block
+      uint64_t in_size;  // compressed size
+      uint64_t out_size; // uncompressed size (if known in advance)
+      uint64_t user;     // subclass specific
+
+      void *out;
+      size_t out_len;
+      int state;
+      bool accepted; // in_sequence() was called
+    };
+
+    static const int BLOCK_EMPTY = 0;
+    static const int BLOCK_QUEUED = 1;
+    static const int BLOCK_DECODING = 2;
+    static const int BLOCK_DONE = 3;
+    static const int BLOCK_ERROR = 4;
+
+    virtual bool next_block(Block &b) = 0;
+    virtual bool decode_block(Block &b) = 0;
+
+    /*
+     * Called with the lock held before any data of a decoded block is
+     * returned. Return false if "b" does not continue where the previously
+     * returned block ended. All decoded and queued blocks are dropped then,
+     * and after calling resync() (without the lock and with all workers
+     * stopped) enumeration starts again with next_block().
+     */
+    virtual bool in_sequence(Block &) { return true; }
+    virtual void resync() {}
+
+    static bool pread_full(int fd, void *buf, size_t len, uint64_t offset)
+    {
+      while (len > 0)
+      {
+        ssize_t n = ::pread(fd, buf, len, offset);
+        if (n <= 0) return false;
+        buf = ((char*)buf) + n;
+        len -= n;
+        offset += n;
+      }
+      return true;
+    }
+
+    static uint32_t le32(const uint8_t *p)
+    {
+      return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+    }
+
+    // zstd and lz4 share the skippable frames (magic & 0xFFFFFFF0)
+    static const uint32_t SKIPPABLE_MAGIC = 0x184D2A50;
+
+    /*
+     * Returns the size of the data frame at "offset" (starting with the 8
+     * bytes "hdr") in "frame_size". Returns false if it is not a valid frame.
+     */
+    typedef bool (*data_frame_fn)(int fd, uint64_t file_size, uint64_t offset, const uint8_t *hdr, uint64_t &frame_size);
+
+    /*
+     * Returns the size of the frame (data or skippable) at "offset" in
+     * "frame_size", and whether it is a data frame. Returns false if it is
+     * not a valid frame.
+     */
+    static bool frame_at(int fd, uint64_t file_size, uint64_t offset, data_frame_fn data_frame_size,
+                         uint64_t &frame_size, bool &data_frame)
+    {
+      uint8_t hdr[8];
+      if (offset + 8 > file_size || !pread_full(fd, hdr, 8, offset))
+        return false;
+
+      if ((le32(hdr) & 0xFFFFFFF0) == SKIPPABLE_MAGIC)
+      {
+        data_frame = false;
+        frame_size = 8 + (uint64_t)le32(hdr + 4);
+        return offset + frame_size <= file_size;
+      }
+
+      data_frame = true;
+      return data_frame_size(fd, file_size, offset, hdr, frame_size);
+    }
+
+    /*
+     * For next_block(): fills in "b" with the next data frame from
+     * "next_offset" on. If a frame is invalid, the rest of the file becomes
+     * one block, so that decode_block() reports the error.
+     */
+    static bool next_frame(int fd, uint64_t file_size, uint64_t &next_offset, data_frame_fn data_frame_size, Block &b)
+    {
+      while (next_offset < file_size)
+      {
+        uint64_t size;
+        bool data_frame;
+        if (!frame_at(fd, file_size, next_offset, data_frame_size, size, data_frame))
+        {
+          b.offset = next_offset;
+          b.in_size = file_size - next_offset;
+          next_offset = file_size;
+          return true;
+        }
+
+        b.offset = next_offset;
+        b.in_size = size;
+        next_offset += size;
+        if (data_frame) return true;
+      }
+      return false;
+    }
+
+    /*
+     * Returns the number of data frames of the file, counting up to "max".
+     * Returns -1 if a frame is invalid.
+     */
+    static int count_frames(int fd, uint64_t file_size, data_frame_fn data_frame_size, int max)
+    {
+      int data_frames = 0;
+      uint64_t offset = 0;
+      while (offset < file_size && data_frames < max)
+      {
+        uint64_t size;
+        bool data_frame;
+        if (!frame_at(fd, file_size, offset, data_frame_size, size, data_frame))
+          return -1;
+        if (data_frame) ++data_frames;
+        offset += size;
+      }
+      return data_frames;
+    }
+
+  private:
+
+    Block *ring;
+    size_t window;
+    // ring positions: [head, claimed) queued or decoding or done,
+    // [claimed, tail) queued. all positions grow monotonically.
+    uint64_t head;
+    uint64_t claimed;
+    uint64_t tail;
+    size_t out_pos; // read position within ring[head]
+    bool input_eof;
+    bool stopping;
+
+    pthread_t *threads;
+    unsigned num_threads;
+    unsigned requested_threads;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+
+    inline Block &slot(uint64_t pos) { return ring[pos % window]; }
+
+    static void *worker_main(void *ptr)
+    {
+      ((ParallelBlockReader*)ptr)->worker();
+      return NULL;
+    }
+
+    void worker()
+    {
+      pthread_mutex_lock(&mutex);
+      while (!stopping)
+      {
+        if (claimed < tail)
+        {
+          Block &b = slot(claimed++);
+          assert(b.state == BLOCK_QUEUED);
+          b.state = BLOCK_DECODING;
+          pthread_mutex_unlock(&mutex);
+
+          bool ok = decode_block(b);
+
+          pthread_mutex_lock(&mutex);
+          b.state = ok ? BLOCK_DONE : BLOCK_ERROR;
+          pthread_cond_broadcast(&cond);
+        }
+        else if (!input_eof && tail - head < window)
+        {
+          Block &b = slot(tail);
+          memset(&b, 0, sizeof(b));
+          if (next_block(b))
+          {
+            b.state = BLOCK_QUEUED;
+            ++tail;
+          }
+          else
+          {
+            input_eof = true;
+            pthread_cond_broadcast(&cond);
+          }
+        }
+        else
+        {
+          pthread_cond_wait(&cond, &mutex);
+        }
+      }
+      pthread_mutex_unlock(&mutex);
+    }
+
+    void release(Block &b)
+    {
+      if (b.out)
+      {
+        free(b.out);
+        b.out = NULL;
+      }
+      b.out_len = 0;
+      b.state = BLOCK_EMPTY;
+    }
+
+  public:
+
+    ParallelBlockReader()
+    {
+      ring = NULL;
+      threads = NULL;
+      num_threads = 0;
+    }
+
+    bool running() { return threads != NULL; }
+
+    /*
+     * Starts the worker threads. Subclasses call this at the end of their
+     * open().
+     */
+    bool start(unsigned num_threads, size_t window)
+    {
+      assert(!running());
+      assert(num_threads > 0);
+
+      if (window < num_threads) window = num_threads;
+      this->requested_threads = num_threads;
+
+      this->ring = (Block*)malloc(sizeof(Block) * window);
+      this->threads = (pthread_t*)malloc(sizeof(pthread_t) * num_threads);
+      if (!ring || !threads)
+      {
+        free(ring); ring = NULL;
+        free(threads); threads = NULL;
+        return false;
+      }
+      memset(ring, 0, sizeof(Block) * window);
+
+      this->window = window;
+      this->head = this->claimed = this->tail = 0;
+      this->out_pos = 0;
+      this->input_eof = false;
+      this->stopping = false;
+
+      pthread_mutex_init(&mutex, NULL);
+      pthread_cond_init(&cond, NULL);
+
+      this->num_threads = 0;
+      for (unsigned i = 0; i < num_threads; ++i)
+      {
+        if (pthread_create(&threads[i], NULL, worker_main, this) != 0)
+          break;
+        ++this->num_threads;
+      }
+
+      if (this->num_threads == 0)
+      {
+        stop();
+        return false;
+      }
+
+      return true;
+    }
+
+    /*
+     * Stops and joins the worker threads and frees all decoded blocks.
+     */
+    void stop()
+    {
+      if (!running()) return;
+
+      pthread_mutex_lock(&mutex);
+      stopping = true;
+      pthread_cond_broadcast(&cond);
+      pthread_mutex_unlock(&mutex);
+
+      for (unsigned i = 0; i < num_threads; ++i)
+      {
+        pthread_join(threads[i], NULL);
+      }
+
+      for (size_t i = 0; i < window; ++i)
+      {
+        release(ring[i]);
+      }
+
+      pthread_cond_destroy(&cond);
+      pthread_mutex_destroy(&mutex);
+
+      free(threads); threads = NULL;
+      free(ring); ring = NULL;
+      num_threads = 0;
+    }
+
+    virtual ssize_t read(void *buf, size_t buflen)
+    {
+      assert(running());
+
+      pthread_mutex_lock(&mutex);
+      for (;;)
+      {
+        if (head == tail)
+        {
+          if (input_eof)
+          {
+            pthread_mutex_unlock(&mutex);
+            return 0;
+          }
+          pthread_cond_wait(&cond, &mutex);
+          continue;
+        }
+
+        Block &b = slot(head);
+        if (b.state != BLOCK_DONE && b.state != BLOCK_ERROR)
+        {
+          pthread_cond_wait(&cond, &mutex);
+          continue;
+        }
+
+        if (!b.accepted)
+        {
+          if (!in_sequence(b))
+          {
+            pthread_mutex_unlock(&mutex);
+            unsigned n = requested_threads;
+            size_t w = window;
+            stop();
+            resync();
+            if (!start(n, w))
+              return -1;
+            pthread_mutex_lock(&mutex);
+            continue;
+          }
+          b.accepted = true;
+        }
+
+        if (b.state == BLOCK_ERROR)
+        {
+          pthread_mutex_unlock(&mutex);
+          return -1;
+        }
+
+        // only we touch a finished block at "head". copy without the lock.
+        pthread_mutex_unlock(&mutex);
+
+        size_t n = b.out_len - out_pos;
+        if (n > buflen) n = buflen;
+        memcpy(buf, ((const char*)b.out) + out_pos, n);
+        out_pos += n;
+
+        pthread_mutex_lock(&mutex);
+        if (out_pos == b.out_len)
+        {
+          release(b);
+          ++head;
+          out_pos = 0;
+          pthread_cond_broadcast(&cond);
+        }
+
+        if (n > 0)
+        {
+          pthread_mutex_unlock(&mutex);
+          return n;
+        }
+        // empty block. continue with the next one.
+      }
+    }
+};
+
+#endif
@@ -0,0 +1,90 @@
+#ifndef __PEEK_FILE_READER__HEADER__
+#define __PEEK_FILE_READER__HEADER__
+
+#include "FileReader.h"
+#include <stdlib.h> // malloc, free
+#include <string.h> // memcpy
+#include <assert.h>
+
+/*
+ * Reads the first block of another FileReader upfront, so that it can be
+ * inspected with peek() (e.g. for magic bytes) before it is returned by
+ * read(). Works on pipes as no seeking is involved.
+ *
+ * close() also closes the wrapped FileReader. It can be called again (or
+ * after a failed open()), which does nothing.
+ */
+class PeekFileReader : public FileReader
+{
+  FileReader *source;
+  char *buf;
+  size_t len;
+  size_t pos;
+
+  public:
+
+    PeekFileReader()
+    {
+      source = NULL;
+      buf = NULL;
+    }
+
+    /*
+     * Reads up to "bufsize" bytes from "source". Short reads (pipes) are
+     * repeated until at least "min_peek" bytes are available or the input
+     * ends.
+     */
+    bool open(FileReader *source, size_t bufsize = 1L << 16, size_t min_peek = 16)
+    {
+      assert(this->source == NULL);
+      if (bufsize < min_peek) bufsize = min_peek;
+
+      buf = (char*)malloc(bufsize);
+      if (!buf) return false;
+
+      len = 0;
+      pos = 0;
+      while (len < min_peek)
+      {
+        ssize_t n = source->read(buf + len, bufsize - len);
+        if (n < 0)
+        {
+          free(buf); buf = NULL;
+          return false;
+        }
+        if (n == 0) break;
+        len += n;
+      }
+
+      this->source = source;
+      return true;
+    }
+
+    const char *peek() { return buf; }
+    size_t peek_len() { return len; }
+
+    virtual void close()
+    {
+      if (!source) return;
+      free(buf); buf = NULL;
+      source->close();
+      source = NULL;
+    }
+
+    virtual ssize_t read(void *out, size_t outlen)
+    {
+      assert(source);
+
+      if (pos < len)
+      {
+        size_t n = len - pos;
+        if (n > outlen) n = outlen;
+        memcpy(out, buf + pos, n);
+        pos += n;
+        return n;
+      }
+      return source->read(out, outlen);
+    }
+};
+
+#endif
@@ -6,11 +6,10 @@
 #include <string.h>  // memcpy
 #include <assert.h>  // assert
 #include <limits>    // std::numeric_limits
-#include <stdlib.h>  // atof
 #include <endian.h>  // htole64
-#include <math.h>    // pow
 #include "ruby.h"    // Ruby
 #include <ctype.h>   // isspace
+#include "RM_FloatParser.h"
 
 #define RM_ERR_OK 0
 #define RM_ERR_INT_RANGE 1
@@ -18,6 +17,7 @@
 #define RM_ERR_HEX_INV_SIZE 10
 #define RM_ERR_HEX_INV_DIGIT 11
 #define RM_ERR_STR_TOO_LONG 20
+#define RM_ERR_FLOAT_INV 30
 
 struct RM_Conversion
 {
@@ -153,90 +153,24 @@ struct RM_Conversion
     return v;
   }
 
-  // XXX: remove char* cast and string modification!
-  static double str_to_double(const char *s, const char *e)
+  /*
+   * Exact and locale independent. Returns RM_ERR_FLOAT_INV if [s, e) is not
+   * a valid decimal floating point number. An empty field (or only
+   * whitespace) is 0.0, like for the integer types.
+   */
+  static double str_to_double(const char *s, const char *e, int &err)
   {
-    return str_to_double2((char*)s, (char*)e);
-  }
-
-  static double str_to_double2(char *s, char *e)
-  {
-    char c = *e;
-    *e = '\0';
-    double v = atof(s);
-    *e = c;
-    return v;
-  }
-
-  static double str_to_double(const char *str)
-  {
-    return atof(str);
-  }
-
-  static double str_to_double2(const char *s, const char *e, int &err)
-  {
-    double v = 0.0;    
+    double v = 0.0;
     err = RM_ERR_OK;
-
-    bool positive = true;
-    // parse sign
-    for (; s != e; ++s)
-    {
-      char c = *s;
-      if (c == '-')
-      {
-        positive = !positive;
-      }
-      else if (c == '+')
-      {
-        // just skip it
-      }
-      else
-      {
-        break;
-      }
-    }
-      
-    int exp = -1;
-    for (; s != e; ++s)
-    {
-      char c = *s;
-      if (c >= '0' && c <= '9')
-      {
-        v *= 10.0;
-        v += (int)(c-'0');
-        if (exp >= 0)
-          ++exp;
-      }
-      else if (c == '.')
-      {
-        if (exp < 0)
-        {
-          exp = 0;
-        }
-        else
-        {
-          err = RM_ERR_INT_INV; // invalid (duplicate ".")
-          return 0.0;
-        }
-      }
-      else
-      {
-        err = RM_ERR_INT_INV; // invalid character
-        return 0.0;
-      }
-    }
-
-    if (exp > 0)
+    const char *p = s;
+    while (p != e && isspace(*p)) ++p;
+    if (p == e)
+      return 0.0;
+    if (!RM_FloatParser::parse(s, e, v))
     {
-      v /= pow(10, exp);
+      err = RM_ERR_FLOAT_INV;
+      return 0.0;
     }
-
-    if (!positive)
-    {
-      v *= -1.0;
-    }
-
     return v;
   }
 
@@ -548,7 +482,10 @@ struct RM_DOUBLE : RM_Type
 
   virtual int set_from_string(void *a, const char *s, const char *e)
   {
-    element(a) = RM_Conversion::str_to_double(s, e);
+    int err;
+    double v = RM_Conversion::str_to_double(s, e, err);
+    if (err) return err;
+    element(a) = v;
     return RM_ERR_OK;
   }
 
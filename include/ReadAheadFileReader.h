@@ -0,0 +1,181 @@
+#ifndef __READ_AHEAD_FILE_READER__HEADER__
+#define __READ_AHEAD_FILE_READER__HEADER__
+
+#include "FileReader.h"
+#include <pthread.h>
+#include <stdlib.h> // malloc, free
+#include <string.h> // memcpy
+#include <assert.h>
+
+/*
+ * Reads from another FileReader on a separate producer thread into a ring of
+ * fixed-size buffers. This lets e.g. decompression (GzipFileReader,
+ * XzFileReader) overlap with the parsing done by the consumer.
+ *
+ * close() also closes the wrapped FileReader.
+ */
+class ReadAheadFileReader : public FileReader
+{
+  struct Buffer
+  {
+    char *data;
+    ssize_t len; // < 0 error, == 0 eof
+  };
+
+  FileReader *source;
+  Buffer *ring;
+  size_t num_buffers;
+  size_t bufsize;
+  // [head, tail) are filled buffers.
+  size_t head;
+  size_t tail;
+  size_t out_pos; // read position within ring[head]
+  bool done;      // producer has seen eof or error
+  bool stopping;
+
+  pthread_t thread;
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+
+  static void *producer_main(void *ptr)
+  {
+    ((ReadAheadFileReader*)ptr)->producer();
+    return NULL;
+  }
+
+  void producer()
+  {
+    pthread_mutex_lock(&mutex);
+    while (!stopping && !done)
+    {
+      if (tail - head == num_buffers)
+      {
+        pthread_cond_wait(&cond, &mutex);
+        continue;
+      }
+
+      Buffer &b = ring[tail % num_buffers];
+      pthread_mutex_unlock(&mutex);
+
+      b.len = source->read(b.data, bufsize);
+
+      pthread_mutex_lock(&mutex);
+      if (b.len <= 0) done = true;
+      ++tail;
+      pthread_cond_broadcast(&cond);
+    }
+    pthread_mutex_unlock(&mutex);
+  }
+
+  public:
+
+    ReadAheadFileReader()
+    {
+      source = NULL;
+      ring = NULL;
+    }
+
+    /*
+     * Starts reading from "source" in the background, keeping up to
+     * "num_buffers" buffers of "bufsize" bytes filled.
+     */
+    bool open(FileReader *source, size_t num_buffers, size_t bufsize = 1L << 16)
+    {
+      assert(this->source == NULL);
+      assert(num_buffers > 0 && bufsize > 0);
+
+      ring = (Buffer*)malloc(sizeof(Buffer) * num_buffers);
+      if (!ring) return false;
+      for (size_t i = 0; i < num_buffers; ++i)
+      {
+        ring[i].len = 0;
+        ring[i].data = (char*)malloc(bufsize);
+        if (!ring[i].data)
+        {
+          for (size_t k = 0; k < i; ++k) free(ring[k].data);
+          free(ring); ring = NULL;
+          return false;
+        }
+      }
+
+      this->source = source;
+      this->num_buffers = num_buffers;
+      this->bufsize = bufsize;
+      this->head = this->tail = 0;
+      this->out_pos = 0;
+      this->done = false;
+      this->stopping = false;
+
+      pthread_mutex_init(&mutex, NULL);
+      pthread_cond_init(&cond, NULL);
+
+      if (pthread_create(&thread, NULL, producer_main, this) != 0)
+      {
+        pthread_cond_destroy(&cond);
+        pthread_mutex_destroy(&mutex);
+        for (size_t i = 0; i < num_buffers; ++i) free(ring[i].data);
+        free(ring); ring = NULL;
+        this->source = NULL;
+        return false;
+      }
+
+      return true;
+    }
+
+    virtual void close()
+    {
+      assert(source);
+
+      pthread_mutex_lock(&mutex);
+      stopping = true;
+      pthread_cond_broadcast(&cond);
+      pthread_mutex_unlock(&mutex);
+      pthread_join(thread, NULL);
+
+      pthread_cond_destroy(&cond);
+      pthread_mutex_destroy(&mutex);
+
+      for (size_t i = 0; i < num_buffers; ++i) free(ring[i].data);
+      free(ring); ring = NULL;
+
+      source->close();
+      source = NULL;
+    }
+
+    virtual ssize_t read(void *buf, size_t buflen)
+    {
+      assert(source);
+
+      pthread_mutex_lock(&mutex);
+      while (head == tail)
+      {
+        pthread_cond_wait(&cond, &mutex);
+      }
+      Buffer &b = ring[head % num_buffers];
+      pthread_mutex_unlock(&mutex);
+
+      if (b.len <= 0)
+      {
+        // eof or error. stays at "head" for subsequent calls.
+        return b.len;
+      }
+
+      size_t n = b.len - out_pos;
+      if (n > buflen) n = buflen;
+      memcpy(buf, b.data + out_pos, n);
+      out_pos += n;
+
+      if (out_pos == (size_t)b.len)
+      {
+        out_pos = 0;
+        pthread_mutex_lock(&mutex);
+        ++head;
+        pthread_cond_broadcast(&cond);
+        pthread_mutex_unlock(&mutex);
+      }
+
+      return n;
+    }
+};
+
+#endif
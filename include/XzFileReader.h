@@ -3,13 +3,250 @@
 
 #include "FileReader.h"
 #include "PosixFileReader.h"
+#include "ParallelBlockReader.h"
 #include <lzma.h>
 #include <assert.h>
 #include <stdlib.h> // malloc
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h> // pread
+
+/*
+ * Decodes the blocks of a (multi-block) .xz file in parallel. The block
+ * boundaries are taken from the index at the end of each stream, which is
+ * why this only works for seekable files.
+ */
+class XzParallelReader : public ParallelBlockReader
+{
+  int fd;
+  lzma_index *index;
+  lzma_index_iter iter;
+
+  // blocks larger than this are decoded by the serial XzFileReader
+  static const uint64_t MAX_BLOCK_SIZE = 1ULL << 30;
+
+  /*
+   * Reads the indices of all (concatenated) streams, starting from the end
+   * of the file. Follows what "xz --list" does.
+   */
+  static lzma_index *read_index(int fd)
+  {
+    struct stat st;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode))
+      return NULL;
+
+    uint64_t pos = st.st_size;
+    uint64_t stream_padding = 0;
+    lzma_index *combined = NULL;
+    uint8_t buf[LZMA_STREAM_HEADER_SIZE];
+
+    while (pos > 0)
+    {
+      if (pos < 2*LZMA_STREAM_HEADER_SIZE)
+        goto fail;
+
+      if (!pread_full(fd, buf, LZMA_STREAM_HEADER_SIZE, pos - LZMA_STREAM_HEADER_SIZE))
+        goto fail;
+
+      // stream padding (multiple of four null bytes)
+      if (buf[8] == 0 && buf[9] == 0 && buf[10] == 0 && buf[11] == 0)
+      {
+        if (combined == NULL) goto fail; // padding at the end of the file only 
+        pos -= 4;
+        stream_padding += 4;
+        continue;
+      }
+
+      {
+        lzma_stream_flags footer, header;
+        if (lzma_stream_footer_decode(&footer, buf) != LZMA_OK)
+          goto fail;
+
+        if (footer.backward_size > pos - 2*LZMA_STREAM_HEADER_SIZE)
+          goto fail;
+
+        uint64_t index_pos = pos - LZMA_STREAM_HEADER_SIZE - footer.backward_size;
+        uint8_t *ibuf = (uint8_t*)malloc(footer.backward_size);
+        if (!ibuf) goto fail;
+        if (!pread_full(fd, ibuf, footer.backward_size, index_pos))
+        {
+          free(ibuf);
+          goto fail;
+        }
+
+        lzma_index *idx = NULL;
+        uint64_t memlimit = UINT64_MAX;
+        size_t in_pos = 0;
+        lzma_ret ret = lzma_index_buffer_decode(&idx, &memlimit, NULL, ibuf, &in_pos, footer.backward_size);
+        free(ibuf);
+        if (ret != LZMA_OK)
+          goto fail;
+
+        uint64_t blocks_size = lzma_index_total_size(idx);
+        if (index_pos < blocks_size + LZMA_STREAM_HEADER_SIZE)
+        {
+          lzma_index_end(idx, NULL);
+          goto fail;
+        }
+        uint64_t stream_pos = index_pos - blocks_size - LZMA_STREAM_HEADER_SIZE;
+
+        if (!pread_full(fd, buf, LZMA_STREAM_HEADER_SIZE, stream_pos) ||
+            lzma_stream_header_decode(&header, buf) != LZMA_OK ||
+            lzma_stream_flags_compare(&header, &footer) != LZMA_OK ||
+            lzma_index_stream_flags(idx, &footer) != LZMA_OK ||
+            lzma_index_stream_padding(idx, stream_padding) != LZMA_OK)
+        {
+          lzma_index_end(idx, NULL);
+          goto fail;
+        }
+
+        if (combined)
+        {
+          // appends "combined" (the streams that follow) to "idx"
+          if (lzma_index_cat(idx, combined, NULL) != LZMA_OK)
+          {
+            lzma_index_end(idx, NULL);
+            goto fail;
+          }
+        }
+        combined = idx;
+        stream_padding = 0;
+        pos = stream_pos;
+      }
+    }
+
+    return combined;
+
+  fail:
+    if (combined) lzma_index_end(combined, NULL);
+    return NULL;
+  }
+
+  protected:
+
+    virtual bool next_block(Block &b)
+    {
+      if (lzma_index_iter_next(&iter, LZMA_INDEX_ITER_NONEMPTY_BLOCK))
+        return false;
+
+      b.offset = iter.block.compressed_file_offset;
+      b.in_size = iter.block.total_size;
+      b.out_size = iter.block.uncompressed_size;
+      // decode_block() needs the unpadded size and the check type as well
+      b.user = (iter.block.unpadded_size << 8) | (uint64_t)iter.stream.flags->check;
+      return true;
+    }
+
+    virtual bool decode_block(Block &b)
+    {
+      uint8_t *in = (uint8_t*)malloc(b.in_size);
+      if (!in) return false;
+
+      b.out = malloc(b.out_size > 0 ? b.out_size : 1);
+      if (!b.out || !pread_full(fd, in, b.in_size, b.offset))
+      {
+        free(in);
+        return false;
+      }
+
+      lzma_filter filters[LZMA_FILTERS_MAX + 1];
+      lzma_block block;
+      memset(&block, 0, sizeof(block));
+      block.version = 0;
+      block.check = (lzma_check)(b.user & 0xFF);
+      block.filters = filters;
+      block.header_size = lzma_block_header_size_decode(in[0]);
+
+      bool ok = false;
+      if (block.header_size <= b.in_size &&
+          lzma_block_header_decode(&block, NULL, in) == LZMA_OK)
+      {
+        size_t in_pos = block.header_size;
+        size_t out_pos = 0;
+        if (lzma_block_compressed_size(&block, b.user >> 8) == LZMA_OK &&
+            lzma_block_buffer_decode(&block, NULL, in, &in_pos, b.in_size,
+                                     (uint8_t*)b.out, &out_pos, b.out_size) == LZMA_OK)
+        {
+          b.out_len = out_pos;
+          ok = (out_pos == b.out_size);
+        }
+
+        for (size_t i = 0; filters[i].id != LZMA_VLI_UNKNOWN; ++i)
+        {
+          free(filters[i].options);
+        }
+      }
+
+      free(in);
+      return ok;
+    }
+
+  public:
+
+    XzParallelReader()
+    {
+      fd = -1;
+      index = NULL;
+    }
+
+    /*
+     * Returns false if the file has only a single block (or cannot be
+     * handled in parallel for another reason). Use the serial XzFileReader
+     * then.
+     */
+    bool open(const char *path, unsigned threads)
+    {
+      assert(fd == -1);
+
+      fd = ::open(path, O_RDONLY);
+      if (fd == -1)
+        return false;
+
+      index = read_index(fd);
+      if (!index || lzma_index_block_count(index) < 2)
+        goto fail;
+
+      // check that the blocks are of reasonable size
+      lzma_index_iter_init(&iter, index);
+      while (!lzma_index_iter_next(&iter, LZMA_INDEX_ITER_NONEMPTY_BLOCK))
+      {
+        if (iter.block.uncompressed_size > MAX_BLOCK_SIZE ||
+            iter.block.total_size > MAX_BLOCK_SIZE)
+          goto fail;
+      }
+      lzma_index_iter_init(&iter, index);
+
+      if (!start(threads, 2*threads))
+        goto fail;
+
+      return true;
+
+    fail:
+      close();
+      return false;
+    }
+
+    virtual void close()
+    {
+      stop();
+      if (index)
+      {
+        lzma_index_end(index, NULL);
+        index = NULL;
+      }
+      if (fd != -1)
+      {
+        ::close(fd);
+        fd = -1;
+      }
+    }
+};
 
 class XzFileReader : public FileReader
 {
   PosixFileReader pf;
+  XzParallelReader par;
   FileReader *file;
   lzma_stream stream;
   void *inbuf;
@@ -24,20 +261,45 @@ class XzFileReader : public FileReader
       inbuf = NULL;
     }
 
-    bool open(const char *path, unsigned bufsize = 1L << 16)
+    /*
+     * With threads > 1, multi-block files are decoded in parallel by
+     * XzParallelReader. Single-block files use the serial decoder.
+     */
+    bool open(const char *path, unsigned bufsize = 1L << 16, unsigned threads = 0)
     {
       assert(file == NULL);
 
+      if (threads > 1 && par.open(path, threads))
+      {
+        file = &par;
+        return true;
+      }
+
       if (!pf.open(path))
       {
         return false;
       }
-      file = &pf; 
+      if (!open(&pf, bufsize))
+      {
+        pf.close();
+        return false;
+      }
+      return true;
+    }
+
+    /*
+     * Decodes the data read from "source" (serially). close() also closes
+     * "source". If it fails, "source" is left open for the caller to close.
+     */
+    bool open(FileReader *source, unsigned bufsize = 1L << 16)
+    {
+      assert(file == NULL);
+      file = source;
 
       this->inbuf = malloc(bufsize);
       if (!inbuf)
       {
-        file->close(); file = NULL;
+        file = NULL;
         return false;
       }
       this->bufsize = bufsize;
@@ -50,8 +312,8 @@ class XzFileReader : public FileReader
       lzma_ret ret = lzma_stream_decoder(&stream, memory_limit, flags);
       if (ret != LZMA_OK)
       {
-        file->close(); file = NULL;
-	free(inbuf);
+        file = NULL;
+        free(inbuf); inbuf = NULL;
         return false;
       }
 
@@ -67,6 +329,11 @@ class XzFileReader : public FileReader
     virtual void close()
     {
       assert(file);
+      if (file == &par)
+      {
+        par.close(); file = NULL;
+        return;
+      }
       file->close(); file = NULL;
       free(inbuf);
       lzma_end(&stream);
@@ -75,6 +342,8 @@ class XzFileReader : public FileReader
     virtual ssize_t read(void *buf, size_t buflen)
     {
       assert(file);
+      if (file == &par)
+        return par.read(buf, buflen);
 
       do 
       {
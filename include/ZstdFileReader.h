@@ -0,0 +1,306 @@
+#ifndef __ZSTD_FILE_READER__HEADER__
+#define __ZSTD_FILE_READER__HEADER__
+
+#include "FileReader.h"
+#include "PosixFileReader.h"
+#include "ParallelBlockReader.h"
+#include <zstd.h>
+#include <assert.h>
+#include <stdint.h>
+#include <stdlib.h> // malloc
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h> // pread
+
+/*
+ * Decodes the frames of a multi-frame .zst file (e.g. written by pzstd or in
+ * the seekable format) in parallel. Frame boundaries are found by walking the
+ * frame and block headers, which only touches a few bytes per 128 KB block.
+ */
+class ZstdParallelReader : public ParallelBlockReader
+{
+  int fd;
+  uint64_t file_size;
+  uint64_t next_offset;
+
+  static const uint32_t MAGIC = 0xFD2FB528;
+
+  // see ParallelBlockReader::data_frame_fn
+  static bool data_frame_size(int fd, uint64_t file_size, uint64_t offset, const uint8_t *hdr, uint64_t &frame_size)
+  {
+    if (le32(hdr) != MAGIC)
+      return false;
+
+    // frame header
+    static const int did_size[4] = {0, 1, 2, 4};
+    uint8_t fhd = hdr[4];
+    int fcs_flag = fhd >> 6;
+    bool single_segment = (fhd >> 5) & 1;
+    bool checksum = (fhd >> 2) & 1;
+    int fcs_size = (fcs_flag == 0) ? (single_segment ? 1 : 0) : (1 << fcs_flag);
+    uint64_t pos = offset + 5 + (single_segment ? 0 : 1) + did_size[fhd & 3] + fcs_size;
+
+    // blocks
+    for (;;)
+    {
+      uint8_t bh[3];
+      if (pos + 3 > file_size || !pread_full(fd, bh, 3, pos))
+        return false;
+      uint32_t b = bh[0] | (bh[1] << 8) | (bh[2] << 16);
+      bool last = b & 1;
+      int type = (b >> 1) & 3;
+      uint32_t size = b >> 3;
+      if (type == 3) return false; // reserved
+      pos += 3 + (type == 1 ? 1 : size);
+      if (last) break;
+    }
+    if (checksum) pos += 4;
+
+    frame_size = pos - offset;
+    return pos <= file_size;
+  }
+
+  protected:
+
+    virtual bool next_block(Block &b)
+    {
+      return next_frame(fd, file_size, next_offset, data_frame_size, b);
+    }
+
+    virtual bool decode_block(Block &b)
+    {
+      void *in = malloc(b.in_size);
+      if (!in) return false;
+      if (!pread_full(fd, in, b.in_size, b.offset))
+      {
+        free(in);
+        return false;
+      }
+
+      bool ok = false;
+      unsigned long long content_size = ZSTD_getFrameContentSize(in, b.in_size);
+
+      if (content_size != ZSTD_CONTENTSIZE_UNKNOWN && content_size != ZSTD_CONTENTSIZE_ERROR)
+      {
+        b.out = malloc(content_size > 0 ? content_size : 1);
+        if (b.out)
+        {
+          size_t n = ZSTD_decompress(b.out, content_size, in, b.in_size);
+          if (!ZSTD_isError(n) && n == content_size)
+          {
+            b.out_len = n;
+            ok = true;
+          }
+        }
+      }
+      else if (content_size == ZSTD_CONTENTSIZE_UNKNOWN)
+      {
+        ZSTD_DStream *ds = ZSTD_createDStream();
+        size_t out_capa = 4*b.in_size;
+        b.out = malloc(out_capa);
+        if (ds && b.out)
+        {
+          ZSTD_inBuffer input = {in, (size_t)b.in_size, 0};
+          for (;;)
+          {
+            if (b.out_len == out_capa)
+            {
+              void *p = realloc(b.out, 2*out_capa);
+              if (!p) break;
+              b.out = p;
+              out_capa *= 2;
+            }
+            ZSTD_outBuffer output = {b.out, out_capa, b.out_len};
+            size_t ret = ZSTD_decompressStream(ds, &output, &input);
+            b.out_len = output.pos;
+            if (ZSTD_isError(ret)) break;
+            if (ret == 0)
+            {
+              ok = (input.pos == input.size);
+              break;
+            }
+            if (input.pos == input.size && output.pos < output.size)
+              break; // truncated
+          }
+        }
+        if (ds) ZSTD_freeDStream(ds);
+      }
+
+      free(in);
+      return ok;
+    }
+
+  public:
+
+    ZstdParallelReader()
+    {
+      fd = -1;
+    }
+
+    /*
+     * Returns false if the file does not contain at least two data frames.
+     * Use the serial ZstdFileReader then.
+     */
+    bool open(const char *path, unsigned threads)
+    {
+      assert(fd == -1);
+
+      fd = ::open(path, O_RDONLY);
+      if (fd == -1)
+        return false;
+
+      struct stat st;
+      if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode))
+        goto fail;
+      file_size = st.st_size;
+
+      if (count_frames(fd, file_size, data_frame_size, 2) < 2)
+        goto fail;
+
+      next_offset = 0;
+      if (!start(threads, 2*threads))
+        goto fail;
+
+      return true;
+
+    fail:
+      close();
+      return false;
+    }
+
+    virtual void close()
+    {
+      stop();
+      if (fd != -1)
+      {
+        ::close(fd);
+        fd = -1;
+      }
+    }
+};
+
+class ZstdFileReader : public FileReader
+{
+  PosixFileReader pf;
+  ZstdParallelReader par;
+  FileReader *file;
+  ZSTD_DStream *stream;
+  ZSTD_inBuffer input;
+  void *inbuf;
+  size_t bufsize;
+  bool is_eof;
+  size_t last_ret; // hint returned by ZSTD_decompressStream, 0 at a frame end
+
+  public:
+
+    ZstdFileReader()
+    {
+      file = NULL;
+      inbuf = NULL;
+      stream = NULL;
+    }
+
+    /*
+     * With threads > 1, multi-frame files are decoded in parallel by
+     * ZstdParallelReader.
+     */
+    bool open(const char *path, unsigned bufsize = 1L << 16, unsigned threads = 0)
+    {
+      assert(file == NULL);
+
+      if (threads > 1 && par.open(path, threads))
+      {
+        file = &par;
+        return true;
+      }
+
+      if (!pf.open(path))
+      {
+        return false;
+      }
+      if (!open(&pf, bufsize))
+      {
+        pf.close();
+        return false;
+      }
+      return true;
+    }
+
+    /*
+     * Decodes the data read from "source" (serially). close() also closes
+     * "source". If it fails, "source" is left open for the caller to close.
+     */
+    bool open(FileReader *source, unsigned bufsize = 1L << 16)
+    {
+      assert(file == NULL);
+      file = source;
+
+      this->inbuf = malloc(bufsize);
+      this->stream = ZSTD_createDStream();
+      if (!inbuf || !stream)
+      {
+        file = NULL;
+        free(inbuf); inbuf = NULL;
+        if (stream) ZSTD_freeDStream(stream);
+        stream = NULL;
+        return false;
+      }
+      this->bufsize = bufsize;
+
+      input.src = inbuf;
+      input.size = 0;
+      input.pos = 0;
+      is_eof = false;
+      last_ret = 0;
+
+      return true;
+    }
+
+    virtual void close()
+    {
+      assert(file);
+      file->close();
+      if (file != &par)
+      {
+        free(inbuf); inbuf = NULL;
+        ZSTD_freeDStream(stream); stream = NULL;
+      }
+      file = NULL;
+    }
+
+    virtual ssize_t read(void *buf, size_t buflen)
+    {
+      assert(file);
+      if (file == &par)
+        return par.read(buf, buflen);
+
+      for (;;)
+      {
+        if (!is_eof && input.pos == input.size)
+        {
+          ssize_t n = file->read(this->inbuf, this->bufsize);
+          if (n < 0) return -1;
+          if (n == 0) is_eof = true;
+          input.size = n;
+          input.pos = 0;
+        }
+
+        if (is_eof && input.pos == input.size)
+        {
+          // a truncated frame is an error
+          return (last_ret == 0) ? 0 : -1;
+        }
+
+        ZSTD_outBuffer output = {buf, buflen, 0};
+        last_ret = ZSTD_decompressStream(stream, &output, &input);
+        if (ZSTD_isError(last_ret))
+          return -1;
+
+        if (output.pos > 0)
+          return output.pos;
+      }
+    }
+};
+
+#endif
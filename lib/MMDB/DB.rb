@@ -8,14 +8,83 @@ module MMDB
 
     attr_accessor :modelklass
 
-    def self.open(modelklass, path, *args)
-      db = super(modelklass.model, path, *args)
+    #
+    # Options:
+    #
+    #   :compress  Store keys and values as block-compressed columns.
+    #   :rle       Store the runs of the first key, so that queries can
+    #              skip from run to run.
+    #
+    #   Both must be the same each time the database is opened.
+    #
+    #   :hugepage  Use transparent huge pages for the key and value files.
+    #   :populate  Read in all files on open.
+    #   :numa      :interleave, or the node to bind the mappings to.
+    #              Only effective for databases on tmpfs (see MmapFile.h).
+    #   :reserve   Bytes of address space to reserve per file. Files then
+    #              grow in place, and queries do not take the read lock.
+    #              No file can grow larger.
+    #   :preallocate  Allocate the space of the files as they grow
+    #              (fallocate), and keep it on close.
+    #   :growth_cap  The files double their size up to this many bytes,
+    #              then grow by it.
+    #
+    def self.open(modelklass, path, num_slices, hint_slices, num_records, hint_records, readonly, options={})
+      db = super(modelklass.model, path, num_slices, hint_slices, num_records, hint_records, readonly, options)
       if db
         db.modelklass = modelklass
       end
       db
     end
 
+    #
+    # Raises if the files cannot grow (e.g. the :reserve is exhausted). The
+    # database is unchanged then.
+    #
+    def put_bulk(arr)
+      raise "put_bulk failed" unless super
+      nil
+    end
+
+    #
+    # Commits in a background thread and returns the thread, whose value is
+    # the result of #commit. put_bulk can continue meanwhile.
+    #
+    def commit_async
+      Thread.new { commit }
+    end
+
+    #
+    # Deletes the records matching the queries (only keys count) from all
+    # slices written so far. Durable on return, independent of #commit.
+    #
+    def delete(*queries)
+      queries = [{}] if queries.empty?
+      queries.each {|q|
+        from, to = *self.modelklass.build_query(q)
+        raise "delete_range failed" unless delete_range(from, to)
+      }
+      nil
+    end
+
+    #
+    # Copies the records that are not deleted into a new database at +path+,
+    # which physically removes the deleted data. Each batch of +batch+
+    # records becomes one slice. With +dedup+ (see Query#each_batch) the
+    # records are also collapsed. Returns the commit state of the new
+    # database ([num_slices, num_records]) to open it with.
+    #
+    def compact_into(path, options={}, batch=1_000_000, dedup=nil)
+      db = DB.open(self.modelklass, path, 0, 1024, 0, batch, false, options)
+      raise "Cannot open a database" unless db
+      begin
+        query().each_batch(batch, false, dedup) {|arr| db.put_bulk(arr)}
+        db.commit
+      ensure
+        db.close
+      end
+    end
+
     # Redefine snapshot method
     def snapshot
       DB::Snapshot.new(self, get_snapshot_num())
@@ -24,6 +93,10 @@ module MMDB
     def query(*queries)
       RecordModel::Query.new(self.snapshot, self.modelklass, *queries)
     end
+
+    def multi_get(keys, itemarr=nil)
+      self.snapshot.multi_get(keys, itemarr)
+    end
   end
 
   class DB::Snapshot
@@ -53,8 +126,39 @@ module MMDB
       RecordModel::Query.new(self, self.modelklass, *queries)
     end
 
+    #
+    # Looks up the records whose keys equal those of one of the records in
+    # +keys+ (a RecordModelInstanceArray) in a single call, and appends
+    # them to +itemarr+. Records with several matches in the database are
+    # all returned, and the result is not in the order of +keys+.
+    #
+    def multi_get(keys, itemarr=nil)
+      itemarr ||= self.modelklass.make_array(keys.size)
+      unless @db.multi_get_into(keys, self.modelklass.new, itemarr, @snapshot)
+        raise "multi_get failed"
+      end
+      itemarr
+    end
+
+    #
+    # Yields +item+ set to each record within [from, to]. The records are
+    # read in batches through a cursor, so nothing is pinned while the
+    # block runs, which may break out or raise.
+    #
     def query_each(from, to, item, &block)
-      @db.query_each(from, to, item, @snapshot, &block)
+      c = cursor(from, to)
+      itemarr = self.modelklass.make_array(1024)
+      loop do
+        itemarr.reset
+        more = c.fetch(itemarr, 1024)
+        itemarr._each(item, &block)
+        break unless more
+      end
+      nil
+    end
+
+    def cursor(from, to, ordered=false, dedup=nil)
+      @db.cursor(from, to, @snapshot, ordered, dedup)
     end
 
     def query_into(from, to, item, itemarr)
@@ -72,6 +176,22 @@ module MMDB
     def query_aggregate(from, to, item, arr, fields, sum)
       @db.query_aggregate(from, to, item, arr, fields, sum, @snapshot)
     end
+
+    def query_top(from, to, item, arr, k, field, desc)
+      @db.query_top(from, to, item, arr, k, field, desc, @snapshot)
+    end
+
+    def query_count_ranges(froms, tos, threads, min_records=RecordModelMMDB::MIN_RECORDS_PER_THREAD)
+      @db.query_count_ranges(froms, tos, threads, min_records, @snapshot)
+    end
+
+    def query_into_ranges(froms, tos, item, itemarr)
+      @db.query_into_ranges(froms, tos, item, itemarr, @snapshot)
+    end
+
+    def query_aggregate_ranges(froms, tos, item, arr, fields, sum)
+      @db.query_aggregate_ranges(froms, tos, item, arr, fields, sum, @snapshot)
+    end
   end
 
 end # module MMDB
@@ -1,5 +1,6 @@
 require 'MMDB/DB'
 require 'MMDB/CommitLog'
+require 'MMDB/PartitionedDB'
 
 module MMDB
 
@@ -24,29 +25,53 @@ module MMDB
 
       @commit_log = CommitLog.new(File.join(@dirname, "commit"))
 
-      # parse the commit record
+      # parse the commit record: the external state, then per schema
+      # num_slices, num_records. For a partitioned schema, the number of
+      # partitions instead, each followed by pid, num_slices, num_records.
       cr = {}
       if str = @commit_log.last
         logr = str.split(",").map {|i| Integer(i)}
-        raise "invalid commit log entry" if logr.size != (2*@schemas.size+1)
-        @external_state = logr.shift 
-        @schemas.each {|arr| id = arr.first; cr[id] = logr.shift(2)}
-        raise unless logr.empty? 
+        take = lambda {|n|
+          raise "invalid commit log entry" if logr.size < n
+          logr.shift(n)
+        }
+        @external_state = take.call(1).first
+        @schemas.each {|arr|
+          id, options = arr[0], arr[4] || {}
+          if options[:partition]
+            cr[id] = {}
+            take.call(1).first.times {
+              pid, num_slices, num_records = *take.call(3)
+              cr[id][pid] = [num_slices, num_records]
+            }
+          else
+            cr[id] = take.call(2)
+          end
+        }
+        raise "invalid commit log entry" unless logr.empty?
       else
         @external_state = 0
-        @schemas.each {|arr| id = arr.first; cr[id] = [0, 0]}
+        @schemas.each {|arr| id = arr.first; cr[id] = (arr[4] || {})[:partition] ? {} : [0, 0]}
       end
 
       @dbs = {}
 
       @schemas.each do |arr|
-        id, klass, hint1, hint2 = *arr
+        id, klass, hint1, hint2, options = *arr
         raise ArgumentError unless id.is_a?(Symbol)
         raise ArgumentError unless klass
         raise ArgumentError if @dbs[id]
         hint0 ||= 1024 
         hint1 ||= 1024*1024
-        db = DB.open(klass, File.join(@dirname, "db_#{id}_"), cr[id][0], hint0, cr[id][1], hint1, @readonly)
+        options ||= {}
+        # [field, width]: a PartitionedDB. The state of all its partitions
+        # is part of the commit record, which has to fit into one block of
+        # the commit log (CommitLog::BLKSIZE).
+        if part = options[:partition]
+          db = PartitionedDB.open(klass, File.join(@dirname, "db_#{id}"), @readonly, part[0], part[1], cr[id], options)
+        else
+          db = DB.open(klass, File.join(@dirname, "db_#{id}_"), cr[id][0], hint0, cr[id][1], hint1, @readonly, options)
+        end
         raise "Cannot open a database" unless db
         @dbs[id] = db
       end
@@ -69,6 +94,11 @@ module MMDB
       get_db(dbid).query(*args, &block)
     end
 
+    def delete(dbid, *queries)
+      raise ArgumentError if @readonly
+      get_db(dbid).delete(*queries)
+    end
+
     attr_reader :external_state
 
     def commit(external_state=0)
@@ -76,17 +106,25 @@ module MMDB
       raise ArgumentError unless external_state
 
       logr = [external_state]
-      @schemas.each {|arr|
-        id = arr.first
-        ok = get_db(id).commit
+      # flush all databases in parallel
+      commits = @schemas.map {|arr| get_db(arr.first).commit_async}
+      commits.each {|thread|
+        ok = thread.value
         raise unless ok
-        num_slices, num_records = *ok
-        logr << num_slices
-        logr << num_records
+        if ok.is_a?(Hash)
+          # the state of a PartitionedDB
+          logr << ok.size
+          ok.keys.sort.each {|pid| logr << pid; logr.concat(ok[pid])}
+        else
+          num_slices, num_records = *ok
+          logr << num_slices
+          logr << num_records
+        end
       }
-      raise "invalid commit log entry" if logr.size != (2*@schemas.size+1)
 
-      @commit_log.append(logr.join(","))
+      str = logr.join(",")
+      raise "commit record too large (drop old partitions)" if str.size > CommitLog::BLKSIZE
+      @commit_log.append(str)
 
       @external_state = external_state
 
@@ -0,0 +1,231 @@
+require 'MMDB/DB'
+require 'fileutils'
+
+module MMDB
+
+  #
+  # A database partitioned by an integer key field, e.g. one partition per
+  # day of a timestamp (+width+ 86400). The records with
+  # floor(field / width) == n go into partition n, which is a DB of its own
+  # in the directory "p<n>".
+  #
+  # Like a DB, it keeps no commit log: #commit returns the committed state
+  # of all partitions, which the database is opened with again (the DBMS
+  # records it in its commit log).
+  #
+  # Partitions are only opened when written or queried, and a query only
+  # considers the partitions its range of the field overlaps. Old
+  # partitions are dropped by removing their directory.
+  #
+  class PartitionedDB
+    def self.open(*args)
+      new(*args)
+    end
+
+    attr_reader :modelklass
+
+    #
+    # +state+ is what #commit returned ({} for a new database). Options are
+    # those of DB.open, plus
+    #
+    #   :hint_slices, :hint_records  The initial capacity of each partition.
+    #
+    def initialize(modelklass, dirname, readonly, field, width, state={}, options={})
+      raise ArgumentError unless width.is_a?(Integer) && width > 0
+      @modelklass = modelklass
+      @dirname = dirname
+      @readonly = readonly
+      @field = modelklass.sym_to_fld_idx(field)
+      @width = width
+      @options = options
+      @hint_slices = options[:hint_slices] || 1024
+      @hint_records = options[:hint_records] || 1024*1024
+
+      raise ArgumentError if File.exist?(@dirname) && !File.directory?(@dirname)
+      Dir.mkdir(@dirname) unless @readonly || File.exist?(@dirname)
+
+      # partitions dropped after the state was committed are gone
+      @state = {}
+      state.each {|pid, sr| @state[pid] = sr if File.directory?(partition_dir(pid))}
+      @pids = @state.keys.sort
+      @dbs = {}
+    end
+
+    def partition_of(value)
+      (value / @width).floor
+    end
+
+    #
+    # The numbers of the existing partitions, in ascending order.
+    #
+    def partitions
+      @pids.dup
+    end
+
+    def put_bulk(arr)
+      raise ArgumentError if @readonly
+      parts = {}
+      arr.each_no_dup {|item|
+        pid = partition_of(item[@field])
+        (parts[pid] ||= @modelklass.make_array(1024)) << item
+      }
+      parts.each {|pid, part| partition(pid, true).put_bulk(part)}
+      nil
+    end
+
+    #
+    # Commits all partitions opened so far in parallel. Returns the state of
+    # all partitions, {pid => [num_slices, num_records]}, to open the
+    # database with.
+    #
+    def commit
+      raise ArgumentError if @readonly
+      commits = @dbs.map {|pid, db| [pid, db.commit_async]}
+      commits.each {|pid, thread|
+        ok = thread.value
+        raise unless ok
+        @state[pid] = ok
+      }
+      state
+    end
+
+    #
+    # The committed state (see #commit).
+    #
+    def state
+      h = {}
+      @pids.each {|pid| h[pid] = @state[pid]}
+      h
+    end
+
+    def commit_async
+      Thread.new { commit }
+    end
+
+    #
+    # Queries see everything written so far. Partitions are not snapshotted
+    # together.
+    #
+    def snapshot
+      self
+    end
+
+    def query(*queries)
+      queries = [{}] if queries.empty?
+      PartitionedDB::Query.new(self, queries.map {|q|
+        from, to = *@modelklass.build_query(q)
+        pids = @pids.select {|pid|
+          pid >= partition_of(from[@field]) && pid <= partition_of(to[@field])
+        }
+        pids.map {|pid| partition(pid).query(q)}
+      }.flatten)
+    end
+
+    def delete(*queries)
+      raise ArgumentError if @readonly
+      queries = [{}] if queries.empty?
+      queries.each {|q|
+        from, to = *@modelklass.build_query(q)
+        @pids.each {|pid|
+          next if pid < partition_of(from[@field]) || pid > partition_of(to[@field])
+          partition(pid).delete(q)
+        }
+      }
+      nil
+    end
+
+    #
+    # Closes and removes partition +pid+. It must not be queried meanwhile.
+    #
+    def drop(pid)
+      raise ArgumentError if @readonly
+      return false unless @pids.include?(pid)
+      db = @dbs.delete(pid)
+      db.close if db
+      @state.delete(pid)
+      @pids.delete(pid)
+      FileUtils.rm_rf(partition_dir(pid))
+      true
+    end
+
+    #
+    # Drops all partitions that only hold values of the field below +value+.
+    #
+    def drop_before(value)
+      @pids.select {|pid| pid < partition_of(value)}.each {|pid| drop(pid)}
+    end
+
+    def close
+      @dbs.each_value {|db| db.close}
+      @dbs = {}
+    end
+
+    private
+
+    def partition_dir(pid)
+      File.join(@dirname, "p#{pid}")
+    end
+
+    def partition(pid, create=false)
+      db = @dbs[pid]
+      return db if db
+
+      unless @pids.include?(pid)
+        raise ArgumentError unless create
+        # the directory is left over if it was never committed
+        Dir.mkdir(partition_dir(pid)) unless File.exist?(partition_dir(pid))
+        @state[pid] = [0, 0]
+        @pids << pid
+        @pids.sort!
+      end
+
+      num_slices, num_records = *@state[pid]
+      db = DB.open(@modelklass, File.join(partition_dir(pid), "db_"), num_slices, @hint_slices,
+                   num_records, @hint_records, @readonly, @options)
+      raise "Cannot open a database" unless db
+      @dbs[pid] = db
+    end
+  end
+
+  #
+  # The queries of the partitions a PartitionedDB#query touches.
+  #
+  class PartitionedDB::Query
+    def initialize(db, queries)
+      @db = db
+      @queries = queries
+    end
+
+    def each_batch(*args, &block)
+      @queries.each {|q| q.each_batch(*args, &block)}
+    end
+
+    def each(&block)
+      @queries.each {|q| q.each(&block)}
+    end
+
+    def to_a
+      @queries.map {|q| q.to_a}.flatten
+    end
+
+    def count
+      @queries.inject(0) {|sum, q| sum + q.count}
+    end
+
+    def into(itemarr=nil)
+      itemarr ||= @db.modelklass.make_array(1024)
+      @queries.each {|q| q.into(itemarr)}
+      itemarr
+    end
+
+    def top(k, field=nil, desc=false)
+      fld = field ? @db.modelklass.sym_to_fld_idx(field) : nil
+      RecordModel::Query.top_of(@queries.map {|q| q.top(k, field, desc)}.flatten, k, fld, desc)
+    end
+
+    def min
+      @queries.map {|q| q.min}.compact.min
+    end
+  end
+
+end # module MMDB
@@ -1,13 +1,43 @@
 require 'RecordModelExt'
 
 class AutoFileReader
-  def self.open(path, buflen=2**16, &block)
-    obj = _open(path, buflen)
+  #
+  # The format (gzip, xz, zstd, lz4 or uncompressed) is detected from the
+  # first bytes of the input. Instead of a path, an IO (e.g. $stdin or a
+  # pipe) can be given. It is read through its file descriptor, bypassing
+  # the IO's buffer, and is not closed. Decoding of IOs is always serial.
+  #
+  # With threads > 1, multi-block xz files and multi-member gzip files (and
+  # multi-frame zstd and lz4 files) are decoded in parallel.
+  #
+  # With readahead > 0, the file is read (and decompressed) on a separate
+  # thread into up to readahead buffers of buflen bytes, so that it overlaps
+  # with e.g. RecordModelInstanceArray#bulk_parse_line.
+  #
+  # With async > 0, regular files are read with that many 1 MB reads in
+  # flight. cache is one of :normal, :dontneed (drop the pages once
+  # consumed) or :direct (O_DIRECT), to keep bulk imports from evicting the
+  # page cache used by queries.
+  #
+  # Raises if the input cannot be opened, or if it is compressed in a format
+  # that was not compiled in (see HAVE_ZSTD and HAVE_LZ4).
+  #
+  CACHE_MODES = {:normal => 0, :dontneed => 1, :direct => 2}
+
+  def self.open(path, buflen=2**16, threads=0, readahead=0, async=0, cache=:normal, &block)
+    if path.respond_to?(:fileno)
+      obj = _open_fd(path.fileno, buflen, readahead)
+      # keep the IO (and its fd) alive as long as we read from it
+      obj.instance_variable_set(:@io, path) if obj
+    else
+      obj = _open(path, buflen, threads, readahead, async, CACHE_MODES.fetch(cache))
+    end
+    raise IOError, "cannot open #{path.inspect} (missing or unsupported format)" unless obj
     if block
       begin
         block.call(obj)
       ensure
-        obj.close if obj
+        obj.close
       end
       return nil
     else
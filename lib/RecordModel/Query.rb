@@ -12,9 +12,39 @@ class RecordModel::Query
     @ranges = @queries.map {|q| klass.build_query(q)}
   end
 
+  #
+  # Yields the items in batches of +n+ (reusing the same array), which are
+  # fetched without holding the GVL. Nothing is locked while the block runs.
+  #
+  # If +ordered+, the items of each query come in key order (otherwise
+  # only within a slice). +dedup+ (:last or :sum) collapses items with equal
+  # keys into the last one written, or into one with the sum of the values.
+  # It implies +ordered+.
+  #
+  def each_batch(n=1024, ordered=false, dedup=nil)
+    raise ArgumentError, "batch size must be at least 1" if n < 1
+    itemarr = @klass.make_array(n)
+    @ranges.each {|from, to|
+      cursor = @db.cursor(from, to, ordered, dedup)
+      loop do
+        itemarr.reset
+        more = cursor.fetch(itemarr, n)
+        yield itemarr unless itemarr.empty?
+        break unless more
+      end
+    }
+  end
+
   def each(&block)
-    item = @klass.new
-    @ranges.each {|from, to| @db.query_each(from, to, item, &block)}
+    each_batch {|itemarr| itemarr.each_no_dup(&block)}
+  end
+
+  def each_ordered(&block)
+    each_batch(1024, true) {|itemarr| itemarr.each_no_dup(&block)}
+  end
+
+  def each_dedup(dedup=:last, &block)
+    each_batch(1024, true, dedup) {|itemarr| itemarr.each_no_dup(&block)}
   end
 
   def to_a
@@ -23,30 +53,55 @@ class RecordModel::Query
     arr
   end
 
-  def count
-    item = @klass.new
-    cnt = 0
-    @ranges.each {|from, to| cnt += @db.query_count(from, to, item)}
-    cnt
+  #
+  # count, aggregate and into search all ranges in one pass over the
+  # slices. count uses up to +threads+ threads for large databases.
+  #
+  def count(threads=4)
+    @db.query_count_ranges(@ranges.map {|r| r[0]}, @ranges.map {|r| r[1]}, threads)
   end
 
   def aggregate(fields, itemarr=nil, sum=true)
     fields = fields.map {|field| @klass.sym_to_fld_idx(field) }
     itemarr ||= @klass.make_array(1024) # should be expandable!
     item = @klass.new
-    @ranges.each {|from, to|
-      @db.query_aggregate(from, to, item, itemarr, fields, sum)
-    }
+    @db.query_aggregate_ranges(@ranges.map {|r| r[0]}, @ranges.map {|r| r[1]}, item, itemarr, fields, sum)
     return itemarr
   end
 
   def into(itemarr=nil)
     item = @klass.new()
     itemarr ||= @klass.make_array(1024)
+    unless @db.query_into_ranges(@ranges.map {|r| r[0]}, @ranges.map {|r| r[1]}, item, itemarr)
+      raise "query_into failed"
+    end
+    return itemarr 
+  end
+
+  #
+  # Returns the first +k+ items ordered by +field+ (or by the keys if nil).
+  #
+  def top(k, field=nil, desc=false)
+    fld = field ? @klass.sym_to_fld_idx(field) : nil
+    item = @klass.new()
+    itemarr = @klass.make_array(k)
     @ranges.each {|from, to|
-      raise "query_into failed" unless @db.query_into(from, to, item, itemarr)
+      raise "query_top failed" unless @db.query_top(from, to, item, itemarr, k, fld, desc)
     }
-    return itemarr 
+    res = itemarr.to_a
+    return res if @ranges.size == 1
+    self.class.top_of(res, k, fld, desc)
+  end
+
+  #
+  # Merges the results of several #top calls (+fld+ is a field index).
+  #
+  def self.top_of(items, k, fld=nil, desc=false)
+    items.sort {|a, b|
+      c = fld ? (a[fld] <=> b[fld]) : 0
+      c = (a <=> b) if c == 0
+      desc ? -c : c
+    }.first(k)
   end
 
   def min
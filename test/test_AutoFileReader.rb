@@ -3,6 +3,7 @@ require 'test/unit'
 $LOAD_PATH << "../ext/RecordModel" 
 $LOAD_PATH << "../lib" 
 require 'RecordModel/AutoFileReader'
+require 'zlib'
 
 class TestRecordModel < Test::Unit::TestCase
 
@@ -11,7 +12,7 @@ class TestRecordModel < Test::Unit::TestCase
   end
 
   def teardown
-    `rm test.xz`
+    `rm -f test.xz test_blocks.txt test_blocks.xz test_members.gz test_frames.* test_frames test_sniff.txt`
   end
 
   def test_read
@@ -20,9 +21,21 @@ class TestRecordModel < Test::Unit::TestCase
       assert_equal "allo test", io.read(1000)
       assert_equal nil, io.read(100)
     }
+    assert_raise(IOError) { AutoFileReader.open('does_not_exist') {} }
   end
 
 
+  def test_readahead
+    AutoFileReader.open('test.xz', 4, 0, 2) {|io|
+      str = ""
+      while c = io.read(3)
+        str << c
+      end
+      assert_equal "hallo test", str
+      assert_equal nil, io.read(100)
+    }
+  end
+
   def test_single
     AutoFileReader.open('test.xz') {|io|
       str = ""
@@ -33,4 +46,111 @@ class TestRecordModel < Test::Unit::TestCase
     }
   end
 
+  def test_parallel_xz
+    File.open('test_blocks.txt', 'w') {|f| 100_000.times {|i| f.puts "line #{i}" } }
+    `xz -k -c --block-size=64KiB test_blocks.txt > test_blocks.xz`
+
+    [0, 4].each do |threads|
+      str = ""
+      AutoFileReader.open('test_blocks.xz', 2**16, threads) {|io|
+        while c = io.read(10_000)
+          str << c
+        end
+      }
+      assert_equal File.read('test_blocks.txt'), str
+    end
+  end
+
+  def test_parallel_gz
+    lines = (0 ... 100_000).map {|i| "line #{i}\n" }
+    File.open('test_members.gz', 'wb') {|f|
+      lines.each_slice(1000) {|slice| f.write(Zlib.gzip(slice.join)) }
+    }
+
+    [0, 4].each do |threads|
+      str = ""
+      AutoFileReader.open('test_members.gz', 2**16, threads) {|io|
+        while c = io.read(10_000)
+          str << c
+        end
+      }
+      assert_equal lines.join, str
+    end
+  end
+
+  def test_zstd_lz4
+    omit_unless(AutoFileReader::HAVE_ZSTD && AutoFileReader::HAVE_LZ4, 'zstd or lz4 support not compiled in')
+    omit_unless(system('which zstd lz4 > /dev/null 2>&1'), 'zstd or lz4 not installed')
+
+    lines = (0 ... 100_000).map {|i| "line #{i}\n" }
+    File.open('test_blocks.txt', 'w') {|f| f.write(lines.join) }
+
+    {'zstd' => 'zst', 'lz4' => 'lz4'}.each do |cmd, suffix|
+      # one frame per 1000 lines
+      `rm -f test_frames.#{suffix}`
+      lines.each_slice(1000) {|slice|
+        IO.popen("#{cmd} -q -c >> test_frames.#{suffix}", 'w') {|io| io.write(slice.join) }
+      }
+      `cp test_frames.#{suffix} test_frames`
+
+      ["test_frames.#{suffix}", "test_frames"].each do |path|
+        [0, 4].each do |threads|
+          str = ""
+          AutoFileReader.open(path, 2**16, threads) {|io|
+            while c = io.read(10_000)
+              str << c
+            end
+          }
+          assert_equal lines.join, str
+        end
+      end
+    end
+  end
+
+  def test_sniff
+    lines = (0 ... 10_000).map {|i| "line #{i}\n" }
+    File.open('test_blocks.txt', 'w') {|f| f.write(lines.join) }
+
+    ['cat', 'gzip -c', 'xz -c'].each do |cmd|
+      # misnamed file
+      `#{cmd} test_blocks.txt > test_sniff.txt`
+      str = ""
+      AutoFileReader.open('test_sniff.txt', 100) {|io|
+        while c = io.read(1000)
+          str << c
+        end
+      }
+      assert_equal lines.join, str
+
+      # pipe
+      str = ""
+      IO.popen("#{cmd} test_blocks.txt") {|pipe|
+        AutoFileReader.open(pipe, 100, 0, 2) {|io|
+          while c = io.read(1000)
+            str << c
+          end
+        }
+      }
+      assert_equal lines.join, str
+    end
+  end
+
+  def test_async
+    lines = (0 ... 300_000).map {|i| "line #{i}\n" }
+    File.open('test_blocks.txt', 'w') {|f| f.write(lines.join) }
+    `xz -k -c test_blocks.txt > test_blocks.xz`
+
+    ['test_blocks.txt', 'test_blocks.xz'].each do |path|
+      [:normal, :dontneed, :direct].each do |cache|
+        str = ""
+        AutoFileReader.open(path, 2**16, 0, 0, 3, cache) {|io|
+          while c = io.read(10_000)
+            str << c
+          end
+        }
+        assert_equal lines.join, str
+      end
+    end
+  end
+
 end
@@ -5,6 +5,8 @@ $LOAD_PATH << "../ext/MMDB"
 $LOAD_PATH << "../lib" 
 require 'RecordModel/RecordModel'
 require 'MMDB/DB'
+require 'MMDB/PartitionedDB'
+require 'MMDB/DBMS'
 
 class TestMMDB < Test::Unit::TestCase
 
@@ -47,4 +49,672 @@ class TestMMDB < Test::Unit::TestCase
     db.close
   end
 
+  def test_compress
+    klass = RecordModel.define do |r|
+      r.key :a, :uint8
+      r.key :b, :uint32
+      r.key :c, :uint64
+      r.val :v, :uint64
+      r.val :h, :hexstr, :size => 16
+    end
+
+    `rm -rf ./tmp.test/db`
+    `mkdir -p ./tmp.test/db`
+    db = MMDB::DB.open(klass, "./tmp.test/db/", 0, 1, 0, 100_000, false, :compress => true)
+
+    arr = klass.make_array(10_000)
+    10_000.times do |i|
+      arr << klass.new(:a => i % 2, :b => 7, :c => 1_000_000_000 + i, :v => i * 3)
+    end
+    db.put_bulk(arr)
+    db.put_bulk(arr)
+    slices, records = *db.commit
+
+    assert_equal 12, db.query(:c => 1_000_000_005 .. 1_000_000_010).count
+    assert_equal 6, db.query(:a => 0, :c => 1_000_000_005 .. 1_000_000_010).count
+    assert_equal 0, db.query(:b => 8).count
+    sum = 0
+    db.query(:a => 1, :c => 1_000_000_000 .. 1_000_000_100).each {|r| sum += r.v}
+    assert_equal 2*3*(1..99).step(2).inject(:+), sum
+    db.close
+
+    db = MMDB::DB.open(klass, "./tmp.test/db/", slices, 1, records, 100_000, true, :compress => true)
+    assert_equal 12, db.query(:c => 1_000_000_005 .. 1_000_000_010).count
+    assert_equal 20_000, db.query(:b => 7).count
+    db.close
+    `rm -rf ./tmp.test/db`
+  end
+
+  def test_compress_strings
+    klass = RecordModel.define do |r|
+      r.key :country, :string, :size => 12
+      r.key :id, :uint32
+      r.val :partner, :hexstr, :size => 4
+    end
+    countries = %w(de fr uk us)
+
+    `rm -rf ./tmp.test/db`
+    `mkdir -p ./tmp.test/db`
+    db = MMDB::DB.open(klass, "./tmp.test/db/", 0, 1, 0, 100_000, false, :compress => true)
+
+    arr = klass.make_array(10_000)
+    10_000.times do |i|
+      arr << klass.new(:country => countries[i % 4], :id => i, :partner => (i % 3).to_s)
+    end
+    db.put_bulk(arr)
+
+    assert_equal 2500, db.query(:country => "fr").count
+    assert_equal 0, db.query(:country => "es").count
+    assert_equal 7500, db.query(:country => "fr" .. "us").count
+    assert_equal 3, db.query(:country => "de" .. "fr", :id => 100 .. 104).count
+    # bounds that are not in the dictionary
+    assert_equal 5000, db.query(:country => "da" .. "gb").count
+    assert_equal 7500, db.query(:country => "e" .. "z").count
+    assert_equal 0, db.query(:country => "a" .. "c").count
+    assert_equal 3, db.query(:country => "da" .. "gb", :id => 100 .. 104).count
+    res = []
+    db.query(:country => "us", :id => 0 .. 20).each {|r| res << [r.country.delete("\0"), r.id, r.partner]}
+    assert_equal [["us", 3, "00000000"], ["us", 7, "00000001"], ["us", 11, "00000002"],
+                  ["us", 15, "00000000"], ["us", 19, "00000001"]], res
+
+    db.close
+    `rm -rf ./tmp.test/db`
+  end
+
+  def test_rle
+    klass = RecordModel.define do |r|
+      r.key :a, :uint8
+      r.key :b, :uint32
+      r.key :c, :uint16
+      r.val :v, :uint32
+    end
+
+    `rm -rf ./tmp.test/db ./tmp.test/dbr`
+    `mkdir -p ./tmp.test/db ./tmp.test/dbr`
+    db = MMDB::DB.open(klass, "./tmp.test/db/", 0, 1, 0, 100_000, false)
+    dbr = MMDB::DB.open(klass, "./tmp.test/dbr/", 0, 1, 0, 100_000, false, :rle => true)
+
+    3.times do |k|
+      arr = klass.make_array(10_000)
+      10_000.times do |i|
+        arr << klass.new(:a => (i * 7) % 5 + 2*k, :b => i % 100, :c => i % 7, :v => i)
+      end
+      db.put_bulk(arr)
+      dbr.put_bulk(arr)
+    end
+
+    [{:a => 3},
+     {:a => 1 .. 5, :b => 10 .. 12},
+     {:a => 0 .. 255, :b => 99, :c => 3 .. 4},
+     {:a => 5 .. 6, :b => 200},
+     {:a => 9},
+     {:a => 20}].each do |q|
+      assert_equal db.query(q).count, dbr.query(q).count
+    end
+    assert_equal 4000, dbr.query(:a => 3).count
+
+    dbr.close
+    db.close
+    `rm -rf ./tmp.test/db ./tmp.test/dbr`
+  end
+
+  def test_commit_async
+    klass = RecordModel.define do |r|
+      r.key :a, :uint32
+      r.val :v, :uint32
+    end
+
+    `rm -rf ./tmp.test/db`
+    `mkdir -p ./tmp.test/db`
+    db = MMDB::DB.open(klass, "./tmp.test/db/", 0, 1, 0, 100_000, false)
+
+    arr = klass.make_array(1000)
+    1000.times {|i| arr << klass.new(:a => i, :v => i)}
+
+    db.put_bulk(arr)
+    commits = (1..3).map { db.commit_async }
+    db.put_bulk(arr)
+    commits.each {|t| assert_include [[1, 1000], [2, 2000]], t.value}
+    assert_equal [2, 2000], db.commit
+    assert_equal [2, 2000], db.commit
+    db.close
+
+    db = MMDB::DB.open(klass, "./tmp.test/db/", 2, 1, 2000, 100_000, true)
+    assert_equal 2, db.query(:a => 5).count
+    db.close
+    `rm -rf ./tmp.test/db`
+  end
+
+  def test_mapping_hints
+    klass = RecordModel.define do |r|
+      r.key :a, :uint32
+      r.val :v, :uint32
+    end
+
+    `rm -rf ./tmp.test/db`
+    `mkdir -p ./tmp.test/db`
+    opts = {:hugepage => true, :populate => true, :numa => :interleave}
+    db = MMDB::DB.open(klass, "./tmp.test/db/", 0, 1, 0, 1000, false, opts)
+    arr = klass.make_array(1000)
+    1000.times {|i| arr << klass.new(:a => i, :v => i)}
+    db.put_bulk(arr)
+    assert_equal [1, 1000], db.commit
+    db.close
+
+    db = MMDB::DB.open(klass, "./tmp.test/db/", 1, 1, 1000, 1000, true, opts.merge(:numa => 0))
+    assert_equal 10, db.query(:a => 10 .. 19).count
+    db.close
+
+    assert_raise(ArgumentError) { MMDB::DB.open(klass, "./tmp.test/db/", 1, 1, 1000, 1000, true, :numa => :foo) }
+    `rm -rf ./tmp.test/db`
+  end
+
+  def test_reserve
+    klass = RecordModel.define do |r|
+      r.key :a, :uint64
+      r.val :v, :uint64
+    end
+
+    `rm -rf ./tmp.test/db`
+    `mkdir -p ./tmp.test/db`
+    db = MMDB::DB.open(klass, "./tmp.test/db/", 0, 1, 0, 1000, false, :reserve => 64*1024*1024)
+    # grows the files beyond their initial capacity of 1 MB
+    4.times do |k|
+      arr = klass.make_array(100_000)
+      100_000.times {|i| arr << klass.new(:a => i, :v => k)}
+      db.put_bulk(arr)
+      assert_equal k+1, db.query(:a => 99_999).count
+    end
+    assert_equal [4, 400_000], db.commit
+    db.close
+
+    db = MMDB::DB.open(klass, "./tmp.test/db/", 0, 1, 0, 1000, false, :reserve => 1024*1024)
+    arr = klass.make_array(100_000)
+    100_000.times {|i| arr << klass.new(:a => i)}
+    db.put_bulk(arr)
+    assert_equal 100_000, db.query().count
+
+    # beyond the reservation: fails, and leaves the database unchanged
+    big = klass.make_array(400_000)
+    400_000.times {|i| big << klass.new(:a => i)}
+    assert_raise(RuntimeError) { db.put_bulk(big) }
+    assert_equal 100_000, db.query().count
+    arr.reset
+    100.times {|i| arr << klass.new(:a => i, :v => 1)}
+    db.put_bulk(arr)
+    assert_equal 100_100, db.query().count
+    assert_equal [2, 100_100], db.commit
+    db.close
+    `rm -rf ./tmp.test/db`
+  end
+
+  def test_preallocate
+    klass = RecordModel.define do |r|
+      r.key :a, :uint64
+      r.val :v, :uint64
+    end
+
+    `rm -rf ./tmp.test/db`
+    `mkdir -p ./tmp.test/db`
+    opts = {:preallocate => true, :growth_cap => 1024*1024}
+    db = MMDB::DB.open(klass, "./tmp.test/db/", 0, 1, 0, 1000, false, opts)
+    arr = klass.make_array(300_000)
+    300_000.times {|i| arr << klass.new(:a => i)}
+    db.put_bulk(arr)
+    assert_equal [1, 300_000], db.commit
+    db.close
+    # 2.4 MB of keys: 1 MB, then grown linearly by 1 MB
+    assert_equal 3*1024*1024, File.size("./tmp.test/db/k0_8")
+
+    db = MMDB::DB.open(klass, "./tmp.test/db/", 1, 1, 300_000, 1000, false, opts)
+    db.put_bulk(arr)
+    assert_equal 2, db.query(:a => 299_999).count
+    db.close
+    `rm -rf ./tmp.test/db`
+  end
+
+  def test_concurrent_put_bulk
+    klass = RecordModel.define do |r|
+      r.key :country, :string, :size => 12
+      r.key :id, :uint32
+      r.val :v, :uint32
+    end
+    countries = %w(de fr uk us)
+
+    [false, true].each do |compress|
+      `rm -rf ./tmp.test/db`
+      `mkdir -p ./tmp.test/db`
+      opts = {:compress => compress, :rle => true}
+      db = MMDB::DB.open(klass, "./tmp.test/db/", 0, 1, 0, 1000, false, opts)
+
+      writers = (0...4).map do |w|
+        Thread.new do
+          10.times do |s|
+            arr = klass.make_array(5000)
+            5000.times {|i| arr << klass.new(:country => countries[w], :id => s*5000 + i, :v => w)}
+            db.put_bulk(arr)
+          end
+        end
+      end
+      writers.each {|t| t.join}
+      assert_equal [40, 200_000], db.commit
+      db.close
+
+      db = MMDB::DB.open(klass, "./tmp.test/db/", 40, 1, 200_000, 1000, true, opts)
+      assert_equal 50_000, db.query(:country => "fr").count
+      assert_equal 4, db.query(:id => 12345).count
+      db.query(:country => "uk", :id => 49_990 .. 50_000).each {|r| assert_equal 2, r.v}
+      db.close
+    end
+    `rm -rf ./tmp.test/db`
+  end
+
+  def test_query_each_break
+    klass = RecordModel.define do |r|
+      r.key :a, :uint32
+      r.val :v, :uint32
+    end
+
+    `rm -rf ./tmp.test/db`
+    `mkdir -p ./tmp.test/db`
+    db = MMDB::DB.open(klass, "./tmp.test/db/", 0, 1, 0, 1000, false)
+    arr = klass.make_array(1000)
+    1000.times {|i| arr << klass.new(:a => i, :v => i)}
+    db.put_bulk(arr)
+
+    # the files grow (and their mappings move) while the block runs, which
+    # then leaves early
+    snapshot = db.snapshot
+    n = 0
+    snapshot.query_each(*klass.build_query({}), klass.new) do |item|
+      100.times { db.put_bulk(arr) }
+      n += 1
+      break
+    end
+    assert_equal 1, n
+    assert_raise(RuntimeError) do
+      snapshot.query_each(*klass.build_query({}), klass.new) { raise "stop" }
+    end
+
+    res = []
+    snapshot.query_each(*klass.build_query(:a => 10..12), klass.new) {|item| res << item.a}
+    assert_equal [10, 11, 12], res
+    assert_equal 101_000, db.query().count
+    db.close
+    `rm -rf ./tmp.test/db`
+  end
+
+  def test_cursor
+    klass = RecordModel.define do |r|
+      r.key :a, :uint32
+      r.key :b, :uint32
+      r.val :v, :uint32
+    end
+
+    `rm -rf ./tmp.test/db`
+    `mkdir -p ./tmp.test/db`
+    db = MMDB::DB.open(klass, "./tmp.test/db/", 0, 1, 0, 1000, false)
+    3.times do |s|
+      arr = klass.make_array(100)
+      100.times {|i| arr << klass.new(:a => i % 10, :b => i, :v => s)}
+      db.put_bulk(arr)
+    end
+
+    # carry-forward across batch boundaries
+    res = []
+    sizes = []
+    db.query(:a => 2..4, :b => 30..59).each_batch(7) do |batch|
+      sizes << batch.size
+      batch.each {|r| res << [r.a, r.b, r.v]}
+    end
+    assert_equal 27, res.size
+    assert_equal [7, 7, 7, 6], sizes
+    assert_equal db.query(:a => 2..4, :b => 30..59).to_a.map {|r| [r.a, r.b, r.v]}, res
+
+    # a snapshot cursor does not see later slices
+    cursor = db.snapshot.cursor(*klass.build_query(:a => 0))
+    arr = klass.make_array(1)
+    arr << klass.new(:a => 0)
+    db.put_bulk(arr)
+
+    arr = klass.make_array(100)
+    assert_equal false, cursor.fetch(arr, 100)
+    assert_equal 30, arr.size
+
+    assert_raise(ArgumentError) { db.query().each_batch(0) {} }
+
+    # a cursor must not outlive its database
+    cursor = db.snapshot.cursor(*klass.build_query({}))
+    db.close
+    assert_raise(IOError) { cursor.fetch(arr, 100) }
+    `rm -rf ./tmp.test/db`
+  end
+
+  def test_top
+    klass = RecordModel.define do |r|
+      r.key :a, :uint32
+      r.val :score, :uint32
+    end
+
+    `rm -rf ./tmp.test/db`
+    `mkdir -p ./tmp.test/db`
+    db = MMDB::DB.open(klass, "./tmp.test/db/", 0, 1, 0, 1000, false)
+    all = []
+    4.times do |s|
+      arr = klass.make_array(250)
+      250.times do |i|
+        a = i * 4 + s
+        arr << klass.new(:a => a, :score => (a * 7919) % 1000)
+        all << [a, (a * 7919) % 1000]
+      end
+      db.put_bulk(arr)
+    end
+
+    top = lambda {|res| res.map {|r| [r.a, r.score]}}
+    assert_equal all.sort.first(5), top[db.query().top(5)]
+    assert_equal all.sort.last(5).reverse, top[db.query().top(5, nil, true)]
+    by_score = all.sort_by {|a, score| [-score, a]}
+    assert_equal by_score.first(3), top[db.query().top(3, :score, true)]
+    assert_equal all.select {|a, _| a >= 500}.sort.first(4), top[db.query(:a => 500..999).top(4)]
+    assert_equal [[10, 190], [100, 900]], top[db.query({:a => 100}, {:a => 10}).top(5)]
+    assert_equal [], db.query(:a => 5000).top(5)
+
+    # a full array is reported
+    from, to = *klass.build_query({})
+    arr = klass.make_array(2, false)
+    assert_equal false, db.snapshot.query_top(from, to, klass.new, arr, 20, nil, false)
+    assert_equal arr.capacity, arr.size
+    db.close
+    `rm -rf ./tmp.test/db`
+  end
+
+  def test_ordered
+    klass = RecordModel.define do |r|
+      r.key :a, :uint32
+      r.key :b, :uint32
+      r.val :s, :uint32
+    end
+
+    `rm -rf ./tmp.test/db`
+    `mkdir -p ./tmp.test/db`
+    db = MMDB::DB.open(klass, "./tmp.test/db/", 0, 1, 0, 1000, false)
+    srand(42)
+    all = []
+    5.times do |s|
+      arr = klass.make_array(200)
+      200.times do
+        r = [rand(20), rand(50), s]
+        arr << klass.new(:a => r[0], :b => r[1], :s => r[2])
+        all << r
+      end
+      db.put_bulk(arr)
+    end
+
+    # equal keys in slice order
+    expected = all.select {|a, b, _| (3..12).include?(a) && (10..30).include?(b)}.sort
+    res = []
+    db.query(:a => 3..12, :b => 10..30).each_batch(17, true) do |batch|
+      batch.each {|r| res << [r.a, r.b, r.s]}
+    end
+    assert_equal expected, res
+
+    # a full array that cannot grow ends the fetch without losing a record
+    res = []
+    cursor = db.snapshot.cursor(*klass.build_query(:a => 3..12, :b => 10..30), true)
+    arr = klass.make_array(8, false)
+    loop do
+      arr.reset
+      more = cursor.fetch(arr, 100)
+      arr.each {|r| res << [r.a, r.b, r.s]}
+      break unless more
+    end
+    assert_equal expected, res
+
+    res = []
+    db.query(:a => 7).each_ordered {|r| res << [r.a, r.b, r.s]}
+    assert_equal all.select {|a, _, _| a == 7}.sort, res
+    db.close
+    `rm -rf ./tmp.test/db`
+  end
+
+  def test_dedup
+    klass = RecordModel.define do |r|
+      r.key :hour, :uint32
+      r.key :id, :uint32
+      r.val :clicks, :uint32
+    end
+
+    `rm -rf ./tmp.test/db`
+    `mkdir -p ./tmp.test/db`
+    db = MMDB::DB.open(klass, "./tmp.test/db/", 0, 1, 0, 1000, false)
+    # hour 1 is imported again with corrected numbers
+    [[0, 1], [1, 2], [1, 3]].each do |hour, clicks|
+      arr = klass.make_array(100)
+      100.times {|i| arr << klass.new(:hour => hour, :id => i, :clicks => clicks)}
+      db.put_bulk(arr)
+    end
+
+    res = []
+    db.query(:id => 5).each_dedup {|r| res << [r.hour, r.id, r.clicks]}
+    assert_equal [[0, 5, 1], [1, 5, 3]], res
+
+    res = []
+    db.query(:hour => 1, :id => 10..12).each_dedup(:sum) {|r| res << [r.hour, r.id, r.clicks]}
+    assert_equal [[1, 10, 5], [1, 11, 5], [1, 12, 5]], res
+
+    cnt = 0
+    db.query().each_batch(7, false, :last) {|batch| cnt += batch.size}
+    assert_equal 200, cnt
+    assert_raise(ArgumentError) { db.query().each_batch(7, false, :first) {} }
+    db.close
+    `rm -rf ./tmp.test/db`
+  end
+
+  def test_delete
+    klass = RecordModel.define do |r|
+      r.key :day, :uint32
+      r.key :id, :uint32
+      r.val :v, :uint32
+    end
+
+    `rm -rf ./tmp.test/db ./tmp.test/db2`
+    `mkdir -p ./tmp.test/db ./tmp.test/db2`
+    db = MMDB::DB.open(klass, "./tmp.test/db/", 0, 1, 0, 1000, false)
+    put_days = lambda do |days, v|
+      arr = klass.make_array(1000)
+      days.each {|d| 100.times {|i| arr << klass.new(:day => d, :id => i, :v => v)}}
+      db.put_bulk(arr)
+    end
+    put_days[[1, 2], 0]
+    put_days[[3], 0]
+    put_days[[2, 3], 0]
+
+    # retention: slice 1 is dropped as a whole
+    db.delete(:day => 0..2, :id => 0..99)
+    assert_equal 200, db.query().count
+    assert_equal 0, db.query(:day => 2).count
+
+    # within slices, and in all query modes
+    db.delete(:day => 3, :id => 50..59)
+    assert_equal 180, db.query(:day => 3).count
+    cnt = 0
+    db.query().each_batch(1000, true) {|batch| cnt += batch.size}
+    assert_equal 180, cnt
+    first = db.query(:id => 50..70).top(1).first
+    assert_equal [3, 60], [first.day, first.id]
+
+    # importing again after a delete
+    put_days[[2], 1]
+    assert_equal 100, db.query(:day => 2).count
+    assert_equal [4, 600], db.commit
+    db.close
+
+    db = MMDB::DB.open(klass, "./tmp.test/db/", 4, 1, 600, 1000, true)
+    assert_equal 280, db.query().count
+    state = db.compact_into("./tmp.test/db2/")
+    assert_equal [1, 280], state
+    db.close
+
+    db = MMDB::DB.open(klass, "./tmp.test/db2/", state[0], 1, state[1], 1000, true)
+    assert_equal 280, db.query().count
+    db.close
+    `rm -rf ./tmp.test/db ./tmp.test/db2`
+  end
+
+  def test_ranges
+    klass = RecordModel.define do |r|
+      r.key :day, :uint32
+      r.key :id, :uint32
+      r.val :v, :uint32
+    end
+
+    `rm -rf ./tmp.test/db`
+    `mkdir -p ./tmp.test/db`
+    db = MMDB::DB.open(klass, "./tmp.test/db/", 0, 1, 0, 1000, false)
+    (0...5).each {|d|
+      arr = klass.make_array(100)
+      100.times {|i| arr << klass.new(:day => d, :id => i, :v => 1)}
+      db.put_bulk(arr)
+    }
+    db.delete(:day => 4, :id => 0..9)
+
+    queries = [{:day => 1}, {:day => 3, :id => 10..19}, {:day => 4}]
+    assert_equal 200, db.query(*queries).count
+    assert_equal 200, db.query(*queries).count(1)
+    assert_equal 200, db.query(*queries).into.size
+    assert_equal 200, queries.map {|q| db.query(q).to_a.size}.inject(:+)
+    # overlapping ranges count twice, as before
+    assert_equal 110, db.query({:day => 4}, {:day => 4, :id => 15..34}).count
+
+    # several threads, each taking a stripe of at least 10 records
+    froms, tos = *queries.map {|q| klass.build_query(q)}.transpose
+    all_from, all_to = *klass.build_query({})
+    [1, 2, 3, 8].each {|threads|
+      assert_equal 200, db.snapshot.query_count_ranges(froms, tos, threads, 10)
+      assert_equal 490, db.snapshot.query_count_ranges([all_from], [all_to], threads, 10)
+    }
+
+    sums = db.query(*queries).aggregate([:day]).to_a.map {|i| [i.day, i.v]}
+    assert_equal [[1, 100], [3, 10], [4, 90]], sums
+    db.close
+    `rm -rf ./tmp.test/db`
+  end
+
+  def test_multi_get
+    klass = RecordModel.define do |r|
+      r.key :a, :uint32
+      r.key :b, :uint64
+      r.val :v, :uint32
+    end
+
+    `rm -rf ./tmp.test/db`
+    `mkdir -p ./tmp.test/db`
+    db = MMDB::DB.open(klass, "./tmp.test/db/", 0, 1, 0, 1000, false)
+    2.times {|s|
+      arr = klass.make_array(1000)
+      1000.times {|i| arr << klass.new(:a => i % 3, :b => i, :v => s)}
+      db.put_bulk(arr)
+    }
+    db.delete(:a => 0..2, :b => 500..599)
+
+    keys = klass.make_array(8)
+    [[1, 1], [0, 999], [0, 999], [2, 5], [1, 2], [0, 3], [1, 550]].each {|a, b|
+      keys << klass.new(:a => a, :b => b)
+    }
+    res = db.multi_get(keys).to_a.map {|i| [i.a, i.b, i.v]}
+    assert_equal [[0, 3, 0], [0, 999, 0], [1, 1, 0], [2, 5, 0], [0, 3, 1], [0, 999, 1], [1, 1, 1], [2, 5, 1]], res
+    assert_equal 0, db.multi_get(klass.make_array(1)).size
+    db.close
+    `rm -rf ./tmp.test/db`
+  end
+
+  def test_partitions
+    klass = RecordModel.define do |r|
+      r.key :ts, :timestamp
+      r.key :id, :uint32
+      r.val :v, :uint32
+    end
+
+    `rm -rf ./tmp.test/pdb`
+    day = 86400
+    db = MMDB::PartitionedDB.open(klass, "./tmp.test/pdb", false, :ts, day)
+    arr = klass.make_array(1000)
+    (0...3).each {|d| 100.times {|i| arr << klass.new(:ts => d*day + i, :id => i, :v => d)}}
+    db.put_bulk(arr)
+    assert_equal [0, 1, 2], db.partitions
+    state = db.commit
+    assert_equal({0 => [1, 100], 1 => [1, 100], 2 => [1, 100]}, state)
+    db.close
+
+    db = MMDB::PartitionedDB.open(klass, "./tmp.test/pdb", true, :ts, day, state)
+    # only partition 1 is opened
+    assert_equal 100, db.query(:ts => day..(2*day-1)).count
+    assert_equal 1, db.instance_variable_get(:@dbs).size
+    assert_equal 300, db.query().count
+    assert_equal 20, db.query(:ts => (day+90)..(2*day+9)).count
+    assert_equal [2, 99], db.query().top(1, :ts, true).map {|i| [i.v, i.id]}.first
+    db.close
+
+    db = MMDB::PartitionedDB.open(klass, "./tmp.test/pdb", false, :ts, day, state)
+    db.drop_before(2*day)
+    assert_equal [2], db.partitions
+    assert !File.exist?("./tmp.test/pdb/p0")
+    assert_equal 100, db.query().count
+    db.close
+
+    # a dropped partition is gone, even if the state still lists it
+    db = MMDB::PartitionedDB.open(klass, "./tmp.test/pdb", true, :ts, day, state)
+    assert_equal [2], db.partitions
+    db.close
+    `rm -rf ./tmp.test/pdb`
+
+    # negative values of the field
+    klass = RecordModel.define do |r|
+      r.key :x, :double
+      r.val :v, :uint32
+    end
+    db = MMDB::PartitionedDB.open(klass, "./tmp.test/pdb", false, :x, 1)
+    arr = klass.make_array(10)
+    [-2.5, -0.5, 0.5].each {|x| arr << klass.new(:x => x, :v => 1)}
+    db.put_bulk(arr)
+    assert_equal [-3, -1, 0], db.partitions
+    state = db.commit
+    db.close
+    db = MMDB::PartitionedDB.open(klass, "./tmp.test/pdb", true, :x, 1, state)
+    assert_equal [-3, -1, 0], db.partitions
+    assert_equal 2, db.query(:x => -1.0 .. 1.0).count
+    db.close
+    `rm -rf ./tmp.test/pdb`
+  end
+
+  def test_dbms_partitions
+    klass = RecordModel.define do |r|
+      r.key :ts, :timestamp
+      r.key :id, :uint32
+      r.val :v, :uint32
+    end
+    schemas = [[:plain, klass], [:parts, klass, nil, nil, {:partition => [:ts, 100]}]]
+
+    `rm -rf ./tmp.test/dbms`
+    dbms = MMDB::DBMS.open("./tmp.test/dbms", false, schemas)
+    arr = klass.make_array(10)
+    10.times {|i| arr << klass.new(:ts => i*50, :id => i)}
+    dbms.put_bulk(:plain, arr)
+    dbms.put_bulk(:parts, arr)
+    assert_equal [7, 1, 10, 5, 0, 1, 2, 1, 1, 2, 2, 1, 2, 3, 1, 2, 4, 1, 2], dbms.commit(7)
+
+    # the partitions are committed, but the DBMS is not
+    dbms.put_bulk(:parts, arr)
+    dbms[:parts].commit
+    dbms.close
+
+    dbms = MMDB::DBMS.open("./tmp.test/dbms", true, schemas)
+    assert_equal 7, dbms.external_state
+    assert_equal 10, dbms.query(:plain).count
+    assert_equal 10, dbms.query(:parts).count
+    assert_equal 2, dbms.query(:parts, :ts => 100..199).count
+    dbms.close
+    `rm -rf ./tmp.test/dbms`
+  end
+
 end
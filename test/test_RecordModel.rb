@@ -135,6 +135,21 @@ class TestRecordModel < Test::Unit::TestCase
     from_string(rec, :e, 1.2, "1.2")
     from_string(rec, :e, 1000.0, "1000.0")
     from_string(rec, :e, -1000.0, "-1000.0")
+    from_string(rec, :e, 0.5, "+.5")
+    from_string(rec, :e, 1500.0, "1.5e3")
+    from_string(rec, :e, -0.025, "-2.5E-2")
+    from_string(rec, :e, 0.1, "0.1")
+    from_string(rec, :e, 1.7976931348623157e308, "1.7976931348623157e308")
+    from_string(rec, :e, 5.0e-324, "4.9e-324")
+    from_string(rec, :e, 123456789012345678.0, "123456789012345678901e-3")
+    from_string(rec, :e, RuntimeError, "1.2.3")
+    from_string(rec, :e, RuntimeError, "1e")
+    from_string(rec, :e, RuntimeError, "abc")
+    # empty is 0.0, like for integers
+    from_string(rec, :e, 0.0, "")
+    from_string(rec, :e, 0.0, "  ")
+    # slow path, longer than its stack buffer
+    from_string(rec, :e, 9007199254740994.0, "9007199254740993." + "0" * 600 + "1")
 
     from_string(rec, :f, '00' * 16, "0")
     from_string(rec, :f, 'FF' * 16, "FF" * 16)